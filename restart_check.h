@@ -0,0 +1,2139 @@
+
+/*
+    restart_check.h - The SP800-90B restart sanity check, shared by
+                      restart_sanity_check and restart_slicer --check.
+
+    Contact dj@deadhat.com
+    Copyright (C) 2020  David Johnston
+    Also uses the mpreal library. See mpreal.h for license.
+
+    Contributors:
+    David Johnston.
+
+    Licensing:
+    restart_check.h is under GNU General Public License ("GPL").
+
+
+    GNU General Public License ("GPL") copyright permissions statement:
+    **************************************************************************
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RESTART_CHECK_H
+#define RESTART_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "mpreal.h"
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+// The check's significance level.
+#define RESTART_ALPHA  0.000005
+
+// H_I is the min-entropy of a symbol of at most 8 bits.
+#define RESTART_MAX_HI 8.0
+
+/********
+* The outcome of a restart sanity check on one 1000x1000 matrix.
+*/
+struct restart_result {
+    int bps;
+    double hi;
+    int row_max_max;
+    int column_max_max;
+    int xmax;
+    mpfr::mpreal small_p;
+    mpfr::mpreal bigp;
+    int pass;
+    int xcrit;                  // smallest failing Xmax
+    int early;                  // counting stopped at xcrit, bigp not computed
+    int rows;                   // rows counted when counting stopped
+    const char *engine;         // the engine that computed bigp
+};
+
+/********
+* Running counts for the restart sanity check. Rows can be added one at a
+* time as they arrive, so the matrix does not have to be complete (or even
+* held in memory) before counting starts. A row or column never has more
+* than 1000 entries, so all symbol counts fit in 16 bits.
+*/
+struct restart_counts {
+    int rows;                   // rows counted so far
+    unsigned char bigor;        // OR of every symbol, gives the bits per symbol
+    int row_max_max;            // largest count of one symbol in any row
+    uint16_t *column_frequency; // [1000][256] symbol counts per column
+    int stop_at;                // counting can stop once a count reaches this (0 = never)
+};
+
+inline int restart_counts_init(restart_counts *c)
+{
+    c->rows = 0;
+    c->bigor = 0;
+    c->row_max_max = 0;
+    c->stop_at = 0;
+    c->column_frequency = (uint16_t *)calloc(1000*256, sizeof(uint16_t));
+    return (c->column_frequency == NULL) ? -1 : 0;
+}
+
+inline void restart_counts_free(restart_counts *c)
+{
+    free(c->column_frequency);
+    c->column_frequency = NULL;
+}
+
+/********
+* restart_bps() finds the bits per symbol from the largest symbol value.
+*/
+inline int restart_bps(unsigned char bigor)
+{
+    if      (bigor < 2)   return 1;
+    else if (bigor < 4)   return 2;
+    else if (bigor < 8)   return 3;
+    else if (bigor < 16)  return 4;
+    else if (bigor < 32)  return 5;
+    else if (bigor < 64)  return 6;
+    else if (bigor < 128) return 7;
+    return 8;
+}
+
+/********
+* restart_count_rows() adds nrows rows of 1000 symbols to the running counts.
+* Each row's maximum is complete once its row is counted. The column counts
+* only grow, and their maximum is taken by restart_column_max_max().
+*
+* Rows and columns are counted in one pass over the data. The pass is tiled so
+* that the counters of a block of RESTART_ROW_BLOCK rows and of a tile of
+* RESTART_COLUMN_TILE columns (8 KB and 32 KB of 16 bit counters) stay in L1
+* while the tile is walked, instead of a second column-major pass with a
+* 1000 byte stride. The row maxima only look at the symbol values that have
+* turned up so far. RESTART_STOP_ROWS is a multiple of RESTART_ROW_BLOCK, so
+* a reader feeding whole blocks can check for x_crit between blocks.
+*/
+#define RESTART_ROW_BLOCK   16
+#define RESTART_COLUMN_TILE 64
+
+inline void restart_count_rows(restart_counts *c, const unsigned char *rows, int nrows)
+{
+    uint16_t row_frequency[RESTART_ROW_BLOCK][256];
+    uint16_t *rf;
+    uint16_t *cf;
+    unsigned char bigor = c->bigor;
+    int nsymbols;
+    int first_row;
+    int last_row;
+    int first_column;
+    int last_column;
+    int row;
+    int column;
+    int abyte;
+    int i;
+
+    for (first_row=0;first_row<nrows;first_row+=RESTART_ROW_BLOCK) {
+        last_row = first_row+RESTART_ROW_BLOCK;
+        if (last_row > nrows) last_row = nrows;
+
+        memset(row_frequency, 0, sizeof(row_frequency[0])*(last_row-first_row));
+
+        for (first_column=0;first_column<1000;first_column+=RESTART_COLUMN_TILE) {
+            last_column = first_column+RESTART_COLUMN_TILE;
+            if (last_column > 1000) last_column = 1000;
+
+            for (row=first_row;row<last_row;row++) {
+                const unsigned char *arow = rows+(row*1000);
+
+                rf = row_frequency[row-first_row];
+                cf = c->column_frequency+(first_column*256);
+                for (column=first_column;column<last_column;column++) {
+                    abyte = arow[column];
+                    bigor = bigor | arow[column];
+                    rf[abyte]++;
+                    cf[abyte]++;
+                    cf += 256;
+                }
+            }
+        }
+
+        nsymbols = 1 << restart_bps(bigor);
+        for (row=0;row<(last_row-first_row);row++) {
+            for (i=0;i<nsymbols;i++) {
+                if (row_frequency[row][i] > c->row_max_max) c->row_max_max = row_frequency[row][i];
+            }
+        }
+    }
+    c->bigor = bigor;
+    c->rows += nrows;
+}
+
+/********
+* restart_column_max_max() is the largest count of one symbol in any column.
+* Only the 2^bps symbol values that can occur are looked at.
+*/
+inline int restart_column_max_max(const restart_counts *c)
+{
+    int nsymbols = 1 << restart_bps(c->bigor);
+    int column_max_max = 0;
+    int column;
+    int i;
+
+    for (column=0;column<1000;column++) {
+        const uint16_t *cf = c->column_frequency+(column*256);
+        for (i=0;i<nsymbols;i++) {
+            if (cf[i] > column_max_max) column_max_max = cf[i];
+        }
+    }
+    return column_max_max;
+}
+
+/********
+* restart_counts_reached() is true once a row or column count has reached
+* c->stop_at. Counts only grow, so the Xmax of the complete matrix is at least
+* that. A column can't reach it before stop_at rows are counted, so the
+* columns aren't scanned until then.
+*/
+inline int restart_counts_reached(const restart_counts *c)
+{
+    if (c->stop_at <= 0) return 0;
+    if (c->row_max_max >= c->stop_at) return 1;
+    if (c->rows < c->stop_at) return 0;
+    return (restart_column_max_max(c) >= c->stop_at) ? 1 : 0;
+}
+
+/********
+* Bit-packed counting for 1 bit symbols.
+*
+* Each row is packed into 16 64 bit words (1000 bits, the last word holding
+* 40), so the matrix shrinks from 1 MB to 128 KB. A row's maximum is then
+* max(popcount, 1000-popcount). The number of ones in each column is kept in
+* bit-sliced vertical counters: plane k holds bit k of the count for every
+* column, and adding a packed row is a ripple-carry add across the planes,
+* 64 columns per word operation. 10 planes count up to 1023 rows.
+*/
+#define RESTART_PACKED_WORDS 16
+#define RESTART_COUNT_PLANES 10
+
+// Pack 1000 one-bit symbols into 16 words, column i at bit i%64 of word i/64.
+inline void restart_pack_row(const unsigned char *row, uint64_t *packed)
+{
+    uint64_t x;
+    int w;
+    int i;
+
+    for (w=0;w<RESTART_PACKED_WORDS;w++) packed[w] = 0;
+    for (i=0;i<1000;i+=8) {
+        memcpy(&x, row+i, 8);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        x = __builtin_bswap64(x);
+#endif
+        // With one 0/1 value per byte, this multiply gathers byte j's bit to bit j of the top byte.
+        packed[i/64] |= ((x*0x0102040810204080ULL) >> 56) << (i%64);
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define RESTART_TARGET_CLONES __attribute__((target_clones("avx2","default")))
+#endif
+#endif
+#ifndef RESTART_TARGET_CLONES
+#define RESTART_TARGET_CLONES
+#endif
+
+// Add one packed row to the vertical counters. The loop over the 16 words of
+// each plane is the same for every word, so it vectorises (4 words per
+// instruction with AVX2).
+RESTART_TARGET_CLONES
+inline void restart_add_packed_row(uint64_t planes[RESTART_COUNT_PLANES][RESTART_PACKED_WORDS], const uint64_t *packed)
+{
+    uint64_t carry[RESTART_PACKED_WORDS];
+    uint64_t t;
+    int k;
+    int w;
+
+    for (w=0;w<RESTART_PACKED_WORDS;w++) carry[w] = packed[w];
+    for (k=0;k<RESTART_COUNT_PLANES;k++) {
+        for (w=0;w<RESTART_PACKED_WORDS;w++) {
+            t = planes[k][w] & carry[w];
+            planes[k][w] ^= carry[w];
+            carry[w] = t;
+        }
+    }
+}
+
+/********
+* restart_count_bits() counts nrows rows of 1 bit symbols.
+*/
+inline void restart_count_bits(restart_counts *c, const unsigned char *rows, int nrows)
+{
+    uint64_t planes[RESTART_COUNT_PLANES][RESTART_PACKED_WORDS];
+    uint64_t packed[RESTART_PACKED_WORDS];
+    int ones;
+    int row_max;
+    int row;
+    int column;
+    int k;
+    int w;
+
+    memset(planes, 0, sizeof(planes));
+
+    for (row=0;row<nrows;row++) {
+        restart_pack_row(rows+(row*1000), packed);
+
+        ones = 0;
+        for (w=0;w<RESTART_PACKED_WORDS;w++) ones += __builtin_popcountll(packed[w]);
+        row_max = (ones > (1000-ones)) ? ones : (1000-ones);
+        if (row_max > c->row_max_max) c->row_max_max = row_max;
+
+        restart_add_packed_row(planes, packed);
+    }
+
+    for (column=0;column<1000;column++) {
+        ones = 0;
+        for (k=0;k<RESTART_COUNT_PLANES;k++) {
+            ones |= (int)((planes[k][column/64] >> (column%64)) & 1) << k;
+        }
+        c->column_frequency[(column*256)+1] += ones;
+        c->column_frequency[(column*256)+0] += nrows-ones;
+    }
+    c->rows += nrows;
+}
+
+/********
+* Compare-and-count for 2 to 4 bit symbols.
+*
+* With 4 to 16 symbol values, a scatter increment keeps hitting the same few
+* counters and stalls on store-to-load forwarding. Instead, for each symbol
+* value the row is compared against it as a whole: the matches are summed for
+* the row count and added bytewise into a per-column counter for that symbol.
+* Both loops are plain compares and byte adds, so they vectorise. The column
+* counters are bytes, and are flushed to column_frequency every 255 rows.
+*/
+#define RESTART_BYTE_BLOCK 255
+
+typedef unsigned char restart_v32u8 __attribute__((vector_size(32)));
+
+// Count one row against every symbol value. Returns the row's maximum.
+// A match compares to 0xff, so subtracting the mask adds one. The row's
+// matches are summed in byte lanes (at most 31 per lane) and added across
+// the lanes at the end. The 32 byte vectors are single AVX2 registers in the
+// avx2 clone and pairs of SSE2 registers otherwise.
+template <int NSYMBOLS>
+RESTART_TARGET_CLONES
+inline int restart_count_symbols_row(const unsigned char *row, unsigned char column_count[NSYMBOLS][1000])
+{
+    restart_v32u8 symbol;
+    restart_v32u8 matches;
+    restart_v32u8 values;
+    restart_v32u8 counts;
+    restart_v32u8 eq;
+    int row_max = 0;
+    int n;
+    int s;
+    int i;
+
+    for (s=0;s<NSYMBOLS;s++) {
+        unsigned char *cc = column_count[s];
+
+        for (i=0;i<32;i++) {
+            symbol[i] = s;
+            matches[i] = 0;
+        }
+        for (i=0;i+32<=1000;i+=32) {
+            memcpy(&values, row+i, 32);
+            memcpy(&counts, cc+i, 32);
+            eq = (restart_v32u8)(values == symbol);
+            counts -= eq;
+            matches -= eq;
+            memcpy(cc+i, &counts, 32);
+        }
+        n = 0;
+        for (i=0;i<32;i++) n += matches[i];
+        for (i=992;i<1000;i++) {
+            unsigned char match = (row[i] == s);
+            cc[i] += match;
+            n += match;
+        }
+        if (n > row_max) row_max = n;
+    }
+    return row_max;
+}
+
+/********
+* restart_count_symbols() counts nrows rows of symbols below NSYMBOLS.
+*/
+template <int NSYMBOLS>
+inline void restart_count_symbols(restart_counts *c, const unsigned char *rows, int nrows)
+{
+    unsigned char column_count[NSYMBOLS][1000];
+    int row_max;
+    int first_row;
+    int last_row;
+    int row;
+    int s;
+    int i;
+
+    for (first_row=0;first_row<nrows;first_row+=RESTART_BYTE_BLOCK) {
+        last_row = first_row+RESTART_BYTE_BLOCK;
+        if (last_row > nrows) last_row = nrows;
+
+        memset(column_count, 0, sizeof(column_count));
+        for (row=first_row;row<last_row;row++) {
+            row_max = restart_count_symbols_row<NSYMBOLS>(rows+(row*1000), column_count);
+            if (row_max > c->row_max_max) c->row_max_max = row_max;
+        }
+
+        for (i=0;i<1000;i++) {
+            uint16_t *cf = c->column_frequency+(i*256);
+            for (s=0;s<NSYMBOLS;s++) cf[s] += column_count[s][i];
+        }
+    }
+    c->rows += nrows;
+}
+
+/********
+* Sub-histogram counting for 5 to 8 bit symbols.
+*
+* Runs of one symbol make frequency[abyte]++ wait on the previous increment
+* of the same counter. Each row is therefore counted into RESTART_SUBHISTOGRAMS
+* interleaved histograms, column i going to histogram i%4, and the histograms
+* are summed when the row's maximum is taken. The columns already have a
+* counter set each, so they are counted straight into column_frequency, tiled
+* as in restart_count_rows(). Only the 2^bps symbol values that can occur are
+* zeroed and scanned.
+*/
+#define RESTART_SUBHISTOGRAMS 4
+
+// Sum the sub-histograms of one row and return the largest count.
+template <int NSYMBOLS>
+RESTART_TARGET_CLONES
+inline int restart_subhistogram_max(const uint16_t sub[RESTART_SUBHISTOGRAMS][NSYMBOLS])
+{
+    int row_max = 0;
+    int count;
+    int i;
+
+    for (i=0;i<NSYMBOLS;i++) {
+        count = sub[0][i]+sub[1][i]+sub[2][i]+sub[3][i];
+        if (count > row_max) row_max = count;
+    }
+    return row_max;
+}
+
+/********
+* restart_count_wide() counts nrows rows of symbols below NSYMBOLS.
+*/
+template <int NSYMBOLS>
+inline void restart_count_wide(restart_counts *c, const unsigned char *rows, int nrows)
+{
+    uint16_t sub[RESTART_ROW_BLOCK][RESTART_SUBHISTOGRAMS][NSYMBOLS];
+    uint16_t (*rs)[NSYMBOLS];
+    uint16_t *cf;
+    int row_max;
+    int first_row;
+    int last_row;
+    int first_column;
+    int last_column;
+    int row;
+    int column;
+
+    for (first_row=0;first_row<nrows;first_row+=RESTART_ROW_BLOCK) {
+        last_row = first_row+RESTART_ROW_BLOCK;
+        if (last_row > nrows) last_row = nrows;
+
+        memset(sub, 0, sizeof(sub));
+
+        for (first_column=0;first_column<1000;first_column+=RESTART_COLUMN_TILE) {
+            last_column = first_column+RESTART_COLUMN_TILE;
+            if (last_column > 1000) last_column = 1000;
+
+            for (row=first_row;row<last_row;row++) {
+                const unsigned char *arow = rows+(row*1000);
+
+                rs = sub[row-first_row];
+                cf = c->column_frequency+(first_column*256);
+                // The tiles are 64 wide and 1000 is a multiple of 4.
+                for (column=first_column;column<last_column;column+=4) {
+                    rs[0][arow[column]]++;
+                    rs[1][arow[column+1]]++;
+                    rs[2][arow[column+2]]++;
+                    rs[3][arow[column+3]]++;
+                    cf[arow[column]]++;
+                    cf[256+arow[column+1]]++;
+                    cf[512+arow[column+2]]++;
+                    cf[768+arow[column+3]]++;
+                    cf += 1024;
+                }
+            }
+        }
+
+        for (row=0;row<(last_row-first_row);row++) {
+            row_max = restart_subhistogram_max<NSYMBOLS>(sub[row]);
+            if (row_max > c->row_max_max) c->row_max_max = row_max;
+        }
+    }
+    c->rows += nrows;
+}
+
+/********
+* restart_count_block() counts nrows rows with the kernel for the given bits
+* per symbol. Every symbol in the rows must fit in bps bits.
+*/
+inline void restart_count_block(restart_counts *c, const unsigned char *rows, int nrows, int bps)
+{
+    switch (bps) {
+        case 1:  restart_count_bits(c, rows, nrows); break;
+        case 2:  restart_count_symbols<4>(c, rows, nrows); break;
+        case 3:  restart_count_symbols<8>(c, rows, nrows); break;
+        case 4:  restart_count_symbols<16>(c, rows, nrows); break;
+        case 5:  restart_count_wide<32>(c, rows, nrows); break;
+        case 6:  restart_count_wide<64>(c, rows, nrows); break;
+        case 7:  restart_count_wide<128>(c, rows, nrows); break;
+        default: restart_count_wide<256>(c, rows, nrows); break;
+    }
+}
+
+/********
+* restart_count_range() counts nrows rows like restart_count_block(), but when
+* c->stop_at is set it counts RESTART_STOP_ROWS rows at a time and stops once a
+* count has reached it, or once another thread has raised stop.
+*/
+#define RESTART_STOP_ROWS 64
+
+inline void restart_count_range(restart_counts *c, const unsigned char *rows, int nrows, int bps, std::atomic<int> *stop)
+{
+    int first_row;
+    int n;
+
+    if (c->stop_at <= 0) {
+        restart_count_block(c, rows, nrows, bps);
+        return;
+    }
+
+    for (first_row=0;first_row<nrows;first_row+=RESTART_STOP_ROWS) {
+        if (stop->load() != 0) return;
+        n = nrows-first_row;
+        if (n > RESTART_STOP_ROWS) n = RESTART_STOP_ROWS;
+        restart_count_block(c, rows+(first_row*1000), n, bps);
+        if (restart_counts_reached(c)) {
+            stop->store(1);
+            return;
+        }
+    }
+}
+
+/********
+* restart_count_matrix() counts a complete 1000x1000 matrix. Knowing the
+* whole matrix up front lets it pick a counting kernel for the bits per symbol.
+*
+* With jobs > 1 the rows are split into jobs contiguous ranges, each counted
+* by its own thread into its own counts. The merge takes the largest row
+* maximum and sums the column counts, so the result is exactly the serial one
+* whatever the number of threads. If c->stop_at is set, counting may stop
+* early with fewer than 1000 rows counted, see restart_count_range(). Returns
+* 0, or -1 if the per thread counts can't be allocated.
+*/
+inline int restart_count_matrix(restart_counts *c, const unsigned char *matrix, int jobs)
+{
+    restart_counts *part;
+    std::thread *workers;
+    std::atomic<int> stop(0);
+    unsigned char bigor = 0;
+    int nsymbols;
+    int bps;
+    int first_row;
+    int last_row;
+    int column;
+    int t;
+    int i;
+
+    for (i=0;i<1000000;i++) bigor = bigor | matrix[i];
+    c->bigor = c->bigor | bigor;
+    bps = restart_bps(bigor);
+
+    if (jobs > 1000) jobs = 1000;
+    if (jobs <= 1) {
+        restart_count_range(c, matrix, 1000, bps, &stop);
+        return 0;
+    }
+
+    part = new restart_counts[jobs];
+    for (t=0;t<jobs;t++) {
+        if (restart_counts_init(&part[t]) != 0) {
+            while (t > 0) restart_counts_free(&part[--t]);
+            delete[] part;
+            return -1;
+        }
+        part[t].stop_at = c->stop_at;
+    }
+
+    workers = new std::thread[jobs];
+    for (t=0;t<jobs;t++) {
+        first_row = (1000*t)/jobs;
+        last_row = (1000*(t+1))/jobs;
+        workers[t] = std::thread(restart_count_range, &part[t], matrix+(first_row*1000), last_row-first_row, bps, &stop);
+    }
+    for (t=0;t<jobs;t++) workers[t].join();
+    delete[] workers;
+
+    nsymbols = 1 << bps;
+    for (t=0;t<jobs;t++) {
+        if (part[t].row_max_max > c->row_max_max) c->row_max_max = part[t].row_max_max;
+        for (column=0;column<1000;column++) {
+            uint16_t *cf = c->column_frequency+(column*256);
+            const uint16_t *pf = part[t].column_frequency+(column*256);
+            for (i=0;i<nsymbols;i++) cf[i] += pf[i];
+        }
+        c->rows += part[t].rows;
+        restart_counts_free(&part[t]);
+    }
+    delete[] part;
+    return 0;
+}
+
+/********
+* The binomial tail.
+*
+* Each term of P(X >= x) comes from its neighbour by one multiply and one
+* divide by small exact integers and by r = p/(1-p), and all the terms are
+* positive. With p itself and the first term rounded once, the relative error
+* of the sum stays under about 8n ulps, 2^restart_error_bits(n). So a sum
+* good to bits bits is computed at bits+restart_error_bits(n) of precision
+* rather than at a fixed 2000 digits.
+*
+* Only the verdict, P < alpha or not, needs to be exact. When the sum is
+* within its error bound of alpha, it is computed again with twice the bits,
+* up to the 2000 digits this check has always used.
+*/
+#define RESTART_TAIL_BITS  64
+#define RESTART_MAX_BITS   6644   // 2000 decimal digits
+
+// Bits lost to rounding over a tail of n trials: log2(8n), rounded up.
+inline int restart_error_bits(int n)
+{
+    int bits = 3;
+
+    while ((1L << (bits-3)) < n) bits++;
+    return bits;
+}
+
+// True if value is within its error bound, 2^-(bits-1) relative, of alpha.
+inline int restart_near_alpha(const mpfr::mpreal &value, int bits)
+{
+    using mpfr::mpreal;
+
+    mpreal alpha = RESTART_ALPHA;
+    return (abs(value-alpha) <= ldexp(alpha, 1-bits)) ? 1 : 0;
+}
+
+/********
+* restart_tail_sum() computes P(X >= xmax) for X ~ Binomial(n, p) with p =
+* 2^-hi, good to bits bits. The first term C(n,xmax) p^xmax (1-p)^(n-xmax)
+* is computed directly, then T(j+1) = T(j)*(n-j)/(j+1)*p/(1-p). The
+* term ratio only falls as j grows, so once it is below 1 the terms after
+* T(j) sum to less than T(j)*q/(1-q), and the sum stops when that is below
+* 2^-(bits+2) of the total.
+*/
+inline mpfr::mpreal restart_tail_sum(int n, int xmax, double hi, int bits, int verbose)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+    using std::setw;
+
+    mpreal::set_default_prec(bits+restart_error_bits(n));
+
+    mpreal small_p = pow((mpreal)2.0,(mpreal)-hi);
+    mpreal one_minus_p = ((mpreal)1.0)-small_p;
+    mpreal bigp;
+    mpreal bigp_increment;
+    mpreal ratio;
+    mpreal q;
+    mpreal left;
+    mpreal first;
+    mpreal second;
+    mpreal third;
+    int j;
+
+    if (xmax <= 0) return (mpreal)1.0;
+    if (xmax > n) return (mpreal)0.0;
+    // Every trial succeeds.
+    if (small_p >= 1) return (mpreal)1.0;
+
+    ratio = small_p/one_minus_p;
+
+    first = 1.0;
+    for (j=1;j<=xmax;j++) first = first*(n-xmax+j)/j;
+    second = pow(small_p,(mpreal)xmax);
+    third  = pow(one_minus_p,(mpreal)(n-xmax));
+
+    bigp_increment = first*second*third;
+    bigp = 0.0;
+
+    for (j=xmax;j<=n;j++) {
+        bigp += bigp_increment;
+
+        if (verbose) {
+            cerr <<  "j="        << setw(5)   << j;
+            cerr <<  "  bigp="  << setw(12)   << bigp;
+            cerr <<  "  bigp_increment=" << setw(12)  << bigp_increment;
+            cerr << "  choose(" << n << "," << setw(4) << j << ")=" << setw(12)   << first;
+            cerr << "  pow("<<small_p<<","  << setw(4) << j << ") = "<< setw(12)  << second;
+            cerr << "\tpow(1-p,(" << n << "-j))="  << setw(12)       << third;
+            cerr << endl;
+            // The factors are only kept up to date for the trace.
+            first = first*(n-j)/(j+1);
+            second = second*small_p;
+            third = third/one_minus_p;
+        }
+
+        if (j == n) break;
+        q = ratio*(n-j)/(j+1);
+        bigp_increment = bigp_increment*q;
+
+        if (q < 1) {
+            left = bigp_increment/(((mpreal)1.0)-q);
+            if (left <= ldexp(bigp, -(bits+2))) {
+                if (verbose) cerr << "Stopped at j=" << j << ", the remaining terms sum to less than " << left << endl;
+                break;
+            }
+        }
+    }
+    return bigp;
+}
+
+/********
+* The regularized incomplete beta engine.
+*
+* P(X >= xmax) = I_p(xmax, n-xmax+1), evaluated with the continued fraction
+* for I_x(a,b) by the modified Lentz method. The fraction converges quickly
+* for x < (a+1)/(a+b+2), in O(sqrt(max(a,b))) steps. Above that the symmetry
+* I_x(a,b) = 1-I_(1-x)(b,a) is used, and there P is not small. So the cost
+* barely depends on how far Xmax is from n, where the term sum walks every j
+* from Xmax to n.
+*
+* The prefactor x^a (1-x)^b / (a B(a,b)) is the exp() of a sum of size up to
+* about n log n, so it needs about log2(n) bits more than its result, and each
+* step of the fraction rounds a few times. The engine works at bits +
+* 2*restart_error_bits(n).
+*/
+
+// I_x(a,b) from its continued fraction, with lx = log(x) and l1mx = log(1-x).
+inline mpfr::mpreal restart_beta_fraction(long a, long b, const mpfr::mpreal &x, const mpfr::mpreal &lx, const mpfr::mpreal &l1mx, int bits, int verbose)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+
+    mpreal tiny = ldexp((mpreal)1.0, -4*(int)mpreal::get_default_prec());
+    mpreal front;
+    mpreal aa;
+    mpreal c;
+    mpreal d;
+    mpreal h;
+    mpreal del;
+    mpreal eps = ldexp((mpreal)1.0, -(bits+4));
+    long m;
+    long m2;
+
+    front = exp(a*lx + b*l1mx - (lngamma((mpreal)a)+lngamma((mpreal)b)-lngamma((mpreal)(a+b))))/a;
+
+    c = 1.0;
+    d = 1-(a+b)*x/(a+1);
+    if (abs(d) < tiny) d = tiny;
+    d = 1/d;
+    h = d;
+    for (m=1;;m++) {
+        m2 = 2*m;
+        aa = m*(b-m)*x/((a-1+m2)*(a+m2));
+        d = 1+aa*d;
+        if (abs(d) < tiny) d = tiny;
+        c = 1+aa/c;
+        if (abs(c) < tiny) c = tiny;
+        d = 1/d;
+        h *= d*c;
+        aa = -(a+m)*(a+b+m)*x/((a+m2)*(a+1+m2));
+        d = 1+aa*d;
+        if (abs(d) < tiny) d = tiny;
+        c = 1+aa/c;
+        if (abs(c) < tiny) c = tiny;
+        d = 1/d;
+        del = d*c;
+        h *= del;
+        if (abs(del-1) < eps) break;
+    }
+    if (verbose) cerr << "Incomplete beta I_x(" << a << "," << b << ") continued fraction converged after " << m << " steps" << endl;
+    return front*h;
+}
+
+/********
+* restart_tail_beta() computes P(X >= xmax) for X ~ Binomial(n, p) with p =
+* 2^-hi as I_p(xmax, n-xmax+1), good to bits bits.
+*/
+inline mpfr::mpreal restart_tail_beta(int n, int xmax, double hi, int bits, int verbose)
+{
+    using mpfr::mpreal;
+
+    mpreal::set_default_prec(bits+2*restart_error_bits(n));
+
+    mpreal small_p = pow((mpreal)2.0,(mpreal)-hi);
+    mpreal one_minus_p = ((mpreal)1.0)-small_p;
+    mpreal lp;
+    mpreal lq;
+    long a = xmax;
+    long b = (long)n-xmax+1;
+
+    if ((xmax <= 0) || (small_p >= 1)) return (mpreal)1.0;
+    if (xmax > n) return (mpreal)0.0;
+
+    lp = log(small_p);
+    lq = log1p(-small_p);
+    if (small_p < ((mpreal)(a+1))/(a+b+2)) return restart_beta_fraction(a, b, small_p, lp, lq, bits, verbose);
+    return 1-restart_beta_fraction(b, a, one_minus_p, lq, lp, bits, verbose);
+}
+
+/********
+* Chunked MPFR sum for large n.
+*
+* Beyond RESTART_SUM_CHUNK trials the term sum is split into chunks of
+* RESTART_SUM_CHUNK terms shared out between jobs threads. Each chunk seeds
+* its own first term from lngamma,
+*     T(j0) = exp(lngamma(n+1)-lngamma(j0+1)-lngamma(n-j0+1) + j0 log(p) + (n-j0) log(1-p))
+* and runs the term ratio across the chunk with its own precision context.
+* The chunks are fixed before any are summed, the last one from
+* restart_tail_last(), and their sums are added in chunk order, so the result
+* is the same to the last bit whatever the number of threads.
+*/
+#define RESTART_SUM_CHUNK 4096
+
+/********
+* restart_tail_last() is the last term worth summing for bits bits. Past the
+* peak at max(xmax, (n+1)p) the terms only fall, so it bisects for the first
+* j there with T(j) below T(peak) by 2^-(bits+64)/n, in double log space.
+* The up to n terms after it then sum to less than 2^-(bits+64) of the tail.
+*/
+inline int restart_tail_last(int n, int xmax, double hi, int bits)
+{
+    double p = std::exp2(-hi);
+    double lp = std::log(p);
+    double lq = std::log1p(-p);
+    double lgn = std::lgamma((double)n+1);
+    double drop = (bits+64)*std::log(2.0)+std::log((double)n);
+    double peak_log;
+    int peak;
+    int lo;
+    int hi_j;
+    int mid;
+
+    peak = (int)std::floor((n+1)*p);
+    if (peak < xmax) peak = xmax;
+    if (peak > n) peak = n;
+
+#define RESTART_LOG_TERM(j) (lgn-std::lgamma((double)(j)+1)-std::lgamma((double)(n-(j))+1)+(j)*lp+(n-(j))*lq)
+    peak_log = RESTART_LOG_TERM(peak);
+    if (RESTART_LOG_TERM(n) >= (peak_log-drop)) return n;
+
+    lo = peak;
+    hi_j = n;
+    while ((hi_j-lo) > 1) {
+        mid = lo+(hi_j-lo)/2;
+        if (RESTART_LOG_TERM(mid) < (peak_log-drop)) hi_j = mid;
+        else lo = mid;
+    }
+#undef RESTART_LOG_TERM
+    return hi_j;
+}
+
+// The chunks a worker takes from, and where each chunk's sum goes.
+struct restart_tail_chunks {
+    int n;
+    int first;                  // first term, xmax
+    int last;                   // last term summed
+    int nchunks;
+    double hi;
+    mp_prec_t prec;
+    std::atomic<int> next;      // next chunk to take
+    mpfr::mpreal *partial;      // [nchunks] chunk sums
+};
+
+inline void restart_tail_chunk_worker(restart_tail_chunks *tc)
+{
+    using mpfr::mpreal;
+
+    int chunk;
+    int j0;
+    int j1;
+    int j;
+
+    mpreal::set_default_prec(tc->prec);
+    {
+        mpreal small_p = pow((mpreal)2.0,(mpreal)-tc->hi);
+        mpreal lp = log(small_p);
+        mpreal lq = log1p(-small_p);
+        mpreal ratio = small_p/(((mpreal)1.0)-small_p);
+        mpreal lgn = lngamma((mpreal)tc->n+1);
+        mpreal term;
+        mpreal sum;
+
+        while ((chunk = tc->next.fetch_add(1)) < tc->nchunks) {
+            j0 = tc->first+(chunk*RESTART_SUM_CHUNK);
+            j1 = j0+RESTART_SUM_CHUNK-1;
+            if (j1 > tc->last) j1 = tc->last;
+
+            term = exp(lgn-lngamma((mpreal)j0+1)-lngamma((mpreal)(tc->n-j0)+1)+j0*lp+(tc->n-j0)*lq);
+            sum = 0.0;
+            for (j=j0;j<=j1;j++) {
+                sum += term;
+                term = term*ratio*(tc->n-j)/(j+1);
+            }
+            tc->partial[chunk] = sum;
+        }
+    }
+    mpfr_free_cache();
+}
+
+/********
+* restart_tail_chunked() computes P(X >= xmax) for X ~ Binomial(n, 2^-hi),
+* good to bits bits, on jobs threads. The seeds are the exp() of sums of size
+* up to about n log n, so like the incomplete beta it works at bits +
+* 2*restart_error_bits(n).
+*/
+inline mpfr::mpreal restart_tail_chunked(int n, int xmax, double hi, int bits, int jobs, int verbose)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+
+    restart_tail_chunks tc;
+    std::thread *workers;
+    int c;
+    int t;
+
+    mpreal::set_default_prec(bits+2*restart_error_bits(n));
+    if ((xmax <= 0) || (pow((mpreal)2.0,(mpreal)-hi) >= 1)) return (mpreal)1.0;
+    if (xmax > n) return (mpreal)0.0;
+
+    tc.n = n;
+    tc.first = xmax;
+    tc.last = restart_tail_last(n, xmax, hi, bits);
+    tc.nchunks = (tc.last-xmax)/RESTART_SUM_CHUNK+1;
+    tc.hi = hi;
+    tc.prec = bits+2*restart_error_bits(n);
+    tc.next = 0;
+    tc.partial = new mpreal[tc.nchunks];
+
+    if (jobs > tc.nchunks) jobs = tc.nchunks;
+    if (jobs < 1) jobs = 1;
+    if (verbose) cerr << "Summing terms " << xmax << " to " << tc.last << " in " << tc.nchunks << " chunks on " << jobs << " threads" << endl;
+
+    if (jobs == 1) restart_tail_chunk_worker(&tc);
+    else {
+        workers = new std::thread[jobs];
+        for (t=0;t<jobs;t++) workers[t] = std::thread(restart_tail_chunk_worker, &tc);
+        for (t=0;t<jobs;t++) workers[t].join();
+        delete[] workers;
+    }
+
+    mpreal::set_default_prec(tc.prec);
+    mpreal bigp = 0.0;
+    for (c=0;c<tc.nchunks;c++) bigp += tc.partial[c];
+    delete[] tc.partial;
+    return bigp;
+}
+
+// Tail engines, for restart_tail_engine() and --engine.
+#define RESTART_ENGINE_TIERED 0     // double, then long double, then the MPFR sum
+#define RESTART_ENGINE_SUM    1     // MPFR term ratio sum
+#define RESTART_ENGINE_BETA   2     // MPFR regularized incomplete beta
+#define RESTART_ENGINE_EXACT  3     // GMP rational, see restart_tail_exact()
+
+/********
+* restart_tail() computes P(X >= xmax) with an MPFR engine, the term sum or
+* the incomplete beta, accurately enough to compare it with alpha, starting
+* at RESTART_TAIL_BITS. Sums over more than RESTART_SUM_CHUNK trials are
+* chunked across jobs threads.
+*/
+inline mpfr::mpreal restart_tail(int n, int xmax, double hi, int engine, int jobs, int verbose)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+
+    mpreal bigp;
+    int bits = RESTART_TAIL_BITS;
+
+    for (;;) {
+        if (engine == RESTART_ENGINE_BETA) bigp = restart_tail_beta(n, xmax, hi, bits, verbose);
+        else if (n > RESTART_SUM_CHUNK) bigp = restart_tail_chunked(n, xmax, hi, bits, jobs, verbose);
+        else bigp = restart_tail_sum(n, xmax, hi, bits, verbose);
+        if ((bits >= RESTART_MAX_BITS) || !restart_near_alpha(bigp, bits)) return bigp;
+        bits = bits*2;
+        if (bits > RESTART_MAX_BITS) bits = RESTART_MAX_BITS;
+        if (verbose) cerr << "P(X >= Xmax) is too close to alpha, recomputing with " << bits << " bits" << endl;
+    }
+}
+
+/********
+* Log-factorial tables.
+*
+* log(k!) for k up to RESTART_LF_TABLE, the n of the restart test, is
+* worked out by the compiler and built into the binary for double and long
+* double. restart_ce_log() is a constexpr natural log: halve x into
+* [sqrt(1/2), sqrt(2)) and sum the atanh series, in long double. The table
+* adds these up with a compensated sum, so each entry is within about an ulp
+* of its type, well inside what restart_tail_log() allows for lgamma.
+* restart_log_factorial() looks k up in the table and goes to lgamma past
+* the end of it, so any n works through the one call.
+*/
+#define RESTART_LF_TABLE 1000
+
+constexpr long double restart_ce_log(long double x)
+{
+    long double e = 0;
+    long double z = 0;
+    long double z2 = 0;
+    long double power = 0;
+    long double sum = 0;
+    int i = 0;
+
+    while (x > 1.41421356237309504880168872420969808L) {
+        x = x/2;
+        e = e+1;
+    }
+    while (x < 0.70710678118654752440084436210484904L) {
+        x = x*2;
+        e = e-1;
+    }
+
+    z = (x-1)/(x+1);
+    z2 = z*z;
+    power = z;
+    for (i=1;i<64;i+=2) {
+        sum = sum+power/i;
+        power = power*z2;
+    }
+    return e*0.693147180559945309417232121458176568L + 2*sum;
+}
+
+template <typename T>
+struct restart_lf_table {
+    T v[RESTART_LF_TABLE+1];
+
+    constexpr restart_lf_table() : v()
+    {
+        long double sum = 0;
+        long double c = 0;
+        long double y = 0;
+        long double t = 0;
+        int k = 0;
+
+        v[0] = 0;
+        for (k=1;k<=RESTART_LF_TABLE;k++) {
+            y = restart_ce_log(k)-c;
+            t = sum+y;
+            c = (t-sum)-y;
+            sum = t;
+            v[k] = (T)(sum-c);
+        }
+    }
+};
+
+constexpr restart_lf_table<double> restart_lf_double;
+constexpr restart_lf_table<long double> restart_lf_long_double;
+
+template <typename T>
+inline T restart_log_factorial(int k);
+
+template <>
+inline double restart_log_factorial<double>(int k)
+{
+    if (k <= RESTART_LF_TABLE) return restart_lf_double.v[k];
+    return std::lgamma((double)k+1);
+}
+
+template <>
+inline long double restart_log_factorial<long double>(int k)
+{
+    if (k <= RESTART_LF_TABLE) return restart_lf_long_double.v[k];
+    return std::lgamma((long double)k+1);
+}
+
+/********
+* Hardware float engines for the tail.
+*
+* In log space a term is
+*     log T(j) = lgamma(n+1)-lgamma(j+1)-lgamma(n+1-j) + j log(p) + (n-j) log(1-p)
+* and the tail is the log-sum-exp of the terms, so nothing under or
+* overflows even in double. The log-factorials come from
+* restart_log_factorial(). The bound on log P counts every rounding: 16
+* ulps of the size of each piece of a term (lgamma past the table is not
+* correctly rounded, so it is given 8), the error of log(1-p) when p is near 1, each exp() and
+* add of the running sum, the final log, and the terms left out after the
+* cutoff. A verdict is only taken from a float engine when log P is further
+* than that from log alpha.
+*/
+template <typename T>
+inline void restart_tail_log(int n, int xmax, double hi, T *log_bigp, T *bound)
+{
+    const T eps = std::numeric_limits<T>::epsilon();
+    const T lgn = restart_log_factorial<T>(n);
+    T small_p = std::exp2((T)-hi);
+    T lp;
+    T lq;
+    T lr;
+    T a;
+    T q;
+    T e;
+    T worst = 0;
+    T m = 0;
+    T sum = 0;
+    int terms = 0;
+    int j;
+
+    if ((xmax <= 0) || (small_p >= 1)) {
+        *log_bigp = 0;
+        *bound = 0;
+        return;
+    }
+
+    lp = std::log(small_p);
+    lq = std::log1p(-small_p);
+    lr = lp-lq;
+
+    if (xmax > n) {
+        *log_bigp = -std::numeric_limits<T>::infinity();
+        *bound = 0;
+        return;
+    }
+
+    for (j=xmax;j<=n;j++) {
+        T lgj = restart_log_factorial<T>(j);
+        T lgk = restart_log_factorial<T>(n-j);
+        T jp = j*lp;
+        T kq = (n-j)*lq;
+
+        a = lgn-lgj-lgk+jp+kq;
+        e = eps*(16*(std::fabs(lgn)+std::fabs(lgj)+std::fabs(lgk)+std::fabs(jp)+std::fabs(kq))
+                 + 2*(T)n/(1-small_p) + 16);
+
+        // Running log-sum-exp: the sum is kept relative to the largest term so far.
+        if ((terms == 0) || (a > m)) {
+            sum = (terms == 0) ? 1 : (sum*std::exp(m-a)+1);
+            e += eps*(std::fabs(m-a)+4);
+            m = a;
+        } else {
+            sum += std::exp(a-m);
+            e += eps*(std::fabs(a-m)+4);
+        }
+        if (e > worst) worst = e;
+        terms++;
+
+        // Once the ratio of terms is below 1 the rest sum to at most T*q/(1-q).
+        if (j < n) {
+            q = std::exp(std::log((T)(n-j)/(T)(j+1))+lr);
+            if ((q < (T)0.5) && ((std::exp(a-m)*q/(1-q)) <= (eps*sum))) break;
+        }
+    }
+
+    *log_bigp = m+std::log(sum);
+    *bound = worst + eps*(2*terms+8) + eps*(std::fabs(*log_bigp)+2);
+}
+
+/********
+* restart_tail_fast() evaluates the tail with float type T. Returns 1 and
+* sets bigp if log P is far enough from log alpha to decide the verdict,
+* else 0.
+*/
+template <typename T>
+inline int restart_tail_fast(int n, int xmax, double hi, mpfr::mpreal *bigp, T *bound)
+{
+    const T eps = std::numeric_limits<T>::epsilon();
+    const T log_alpha = std::log((T)RESTART_ALPHA);
+    T log_bigp;
+
+    restart_tail_log<T>(n, xmax, hi, &log_bigp, bound);
+    // Past the range of T, p or the terms underflow and the log is not a number.
+    if (!std::isfinite(*bound) || std::isnan(log_bigp) || ((xmax <= n) && !std::isfinite(log_bigp))) return 0;
+    if (std::fabs(log_bigp-log_alpha) <= (*bound + eps*(std::fabs(log_alpha)+2))) return 0;
+
+    mpfr::mpreal::set_default_prec(RESTART_TAIL_BITS+restart_error_bits(n));
+    if (xmax > n) {
+        *bigp = 0.0;
+        return 1;
+    }
+    *bigp = exp((mpfr::mpreal)log_bigp);
+    return 1;
+}
+
+/********
+* The exact engine.
+*
+* p = 2^-H_I is a dyadic rational m/2^d when H_I is a whole number: m = 1,
+* d = H_I. Otherwise it is rounded to the nearest multiple of
+* 2^-RESTART_EXACT_BITS and that is the p the result is exact for. With
+* q = 2^d-m, every term C(n,j) p^j (1-p)^(n-j) is C(n,j) m^j q^(n-j)/2^(dn),
+* so the tail is an integer numerator over 2^(dn). The first numerator term
+* comes from mpz_bin_uiui() and integer powers, each later one from the one
+* before, multiplied by (n-j)m and divided exactly by (j+1)q. The verdict
+* compares the fraction with alpha as the exact decimal 5/10^6, so nothing
+* depends on a precision setting.
+*/
+#define RESTART_EXACT_BITS 64
+
+// The exact fraction is rounded to this many decimal digits for display and the cache.
+#define RESTART_EXACT_DIGITS 40
+
+// Sets m with p = m/2^d and returns d.
+inline unsigned long restart_exact_p(double hi, mpz_t m)
+{
+    mpfr_t x;
+    unsigned long d;
+
+    if ((hi >= 0) && (hi <= 65536) && (hi == floor(hi))) {
+        mpz_set_ui(m, 1);
+        return (unsigned long)hi;
+    }
+
+    // Enough bits that rounding 2^-hi to the mpfr_t doesn't move the nearest multiple.
+    d = RESTART_EXACT_BITS;
+    mpfr_init2(x, 2*RESTART_EXACT_BITS+64);
+    mpfr_set_d(x, -hi, MPFR_RNDN);
+    mpfr_exp2(x, x, MPFR_RNDN);
+    mpfr_mul_2ui(x, x, d, MPFR_RNDN);
+    mpfr_get_z(m, x, MPFR_RNDN);
+    mpfr_clear(x);
+    return d;
+}
+
+/********
+* restart_tail_exact() computes P(X >= xmax) for X ~ Binomial(n, m/2^d) as
+* num/2^(dn) and returns 1 if it is at least alpha (PASS), 0 if below.
+*/
+inline int restart_tail_exact(int n, int xmax, const mpz_t m, unsigned long d, mpz_t num)
+{
+    mpz_t q;
+    mpz_t term;
+    mpz_t t;
+    mpz_t lhs;
+    int pass;
+    int j;
+
+    mpz_init(q);
+    mpz_init(term);
+    mpz_init(t);
+    mpz_init(lhs);
+
+    mpz_set_ui(num, 0);
+    mpz_ui_pow_ui(q, 2, d);
+    mpz_sub(q, q, m);
+
+    if ((xmax <= 0) || ((xmax <= n) && (mpz_sgn(q) == 0))) {
+        // Every X, or with p = 1 X = n, is at least xmax.
+        mpz_ui_pow_ui(num, 2, d*(unsigned long)n);
+    } else if ((xmax <= n) && (mpz_sgn(m) > 0)) {
+        mpz_bin_uiui(term, n, xmax);
+        mpz_pow_ui(t, m, xmax);
+        mpz_mul(term, term, t);
+        mpz_pow_ui(t, q, n-xmax);
+        mpz_mul(term, term, t);
+
+        for (j=xmax;j<=n;j++) {
+            mpz_add(num, num, term);
+            if (j == n) break;
+            mpz_mul_ui(term, term, n-j);
+            mpz_mul(term, term, m);
+            mpz_divexact_ui(term, term, j+1);
+            mpz_divexact(term, term, q);
+        }
+    }
+
+    // P < 5/10^6  <=>  num*200000 < 2^(dn)
+    mpz_mul_ui(lhs, num, 200000);
+    mpz_ui_pow_ui(t, 2, d*(unsigned long)n);
+    pass = (mpz_cmp(lhs, t) < 0) ? 0 : 1;
+
+    mpz_clear(q);
+    mpz_clear(term);
+    mpz_clear(t);
+    mpz_clear(lhs);
+    return pass;
+}
+
+/********
+* restart_tail_engine() computes P(X >= xmax) for X ~ Binomial(n, 2^-hi) with
+* the given engine, sets name to the one that decided the verdict and pass to
+* the verdict. The tiered engine tries double, then long double, then the
+* MPFR sum, stopping at the first that can decide. With verbose it goes
+* straight to MPFR, for the per-term trace. The exact engine states the p it
+* used on stderr, and its verdict is from the exact fraction, not the value
+* returned for display.
+*/
+inline mpfr::mpreal restart_tail_engine(int n, int xmax, double hi, int engine, int jobs, int verbose, const char **name, int *pass)
+{
+    using std::cerr;
+    using std::endl;
+
+    mpfr::mpreal alpha = RESTART_ALPHA;
+    mpfr::mpreal bigp;
+    double dbound;
+    long double lbound;
+
+    if (engine == RESTART_ENGINE_EXACT) {
+        mpz_t m;
+        mpz_t num;
+        unsigned long d;
+
+        mpz_init(m);
+        mpz_init(num);
+        d = restart_exact_p(hi, m);
+        *name = "exact rational";
+        *pass = restart_tail_exact(n, xmax, m, d, num);
+
+        gmp_fprintf(stderr, "Exact tail for p = %Zd/2^%lu", m, d);
+        if (mpz_cmp_ui(m, 1) != 0) cerr << " (2^-H_I rounded to " << RESTART_EXACT_BITS << " binary places)";
+        cerr << ", alpha = 5/10^6" << endl;
+        if (verbose) cerr << "P(X >= Xmax) = num/2^" << d*(unsigned long)n << " with a " << mpz_sizeinbase(num, 2) << " bit numerator" << endl;
+
+        mpfr::mpreal::set_default_prec(RESTART_TAIL_BITS+restart_error_bits(n));
+        bigp = ldexp(mpfr::mpreal(num, mpfr::digits2bits(RESTART_EXACT_DIGITS)), -(mp_exp_t)(d*(unsigned long)n));
+        mpz_clear(m);
+        mpz_clear(num);
+        return bigp;
+    }
+
+    if (engine == RESTART_ENGINE_BETA) {
+        *name = "MPFR incomplete beta";
+        bigp = restart_tail(n, xmax, hi, RESTART_ENGINE_BETA, jobs, verbose);
+    } else {
+        if ((engine == RESTART_ENGINE_TIERED) && !verbose) {
+            *name = "double";
+            if (restart_tail_fast<double>(n, xmax, hi, &bigp, &dbound)) {
+                *pass = (bigp < alpha) ? 0 : 1;
+                return bigp;
+            }
+            *name = "long double";
+            if (restart_tail_fast<long double>(n, xmax, hi, &bigp, &lbound)) {
+                *pass = (bigp < alpha) ? 0 : 1;
+                return bigp;
+            }
+        }
+        *name = "MPFR";
+        bigp = restart_tail(n, xmax, hi, RESTART_ENGINE_SUM, jobs, verbose);
+    }
+    *pass = (bigp < alpha) ? 0 : 1;
+    return bigp;
+}
+
+/********
+* restart_tail_audit() evaluates the tail with every engine, decided or not,
+* and reports each one's claimed error bound and its actual distance from a
+* 2000 digit MPFR sum.
+*/
+inline void restart_tail_audit(int n, int xmax, double hi)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+    using std::setw;
+
+    mpreal reference;
+    mpreal bigp;
+    double dlog;
+    double dbound;
+    long double llog;
+    long double lbound;
+
+    reference = restart_tail_sum(n, xmax, hi, RESTART_MAX_BITS, 0);
+    restart_tail_log<double>(n, xmax, hi, &dlog, &dbound);
+    restart_tail_log<long double>(n, xmax, hi, &llog, &lbound);
+
+    cerr << endl;
+    cerr << "    ---- Audit -----" << endl;
+    cerr << setw(26) << "MPFR 2000 digits P = " << setw(12) << reference << endl;
+
+    bigp = exp((mpreal)dlog);
+    cerr << setw(26) << "double P = " << setw(12) << bigp;
+    cerr << "  bound " << setw(12) << dbound << "  error " << setw(12) << ((reference == 0) ? (mpreal)0.0 : abs(log(bigp/reference))) << endl;
+
+    bigp = exp((mpreal)llog);
+    cerr << setw(26) << "long double P = " << setw(12) << bigp;
+    cerr << "  bound " << setw(12) << (double)lbound << "  error " << setw(12) << ((reference == 0) ? (mpreal)0.0 : abs(log(bigp/reference))) << endl;
+
+    bigp = restart_tail(n, xmax, hi, RESTART_ENGINE_SUM, 1, 0);
+    cerr << setw(26) << "MPFR P = " << setw(12) << bigp;
+    cerr << "  error " << setw(12) << ((reference == 0) ? (mpreal)0.0 : abs(log(bigp/reference))) << endl;
+
+    bigp = restart_tail(n, xmax, hi, RESTART_ENGINE_BETA, 1, 0);
+    cerr << setw(26) << "MPFR incomplete beta P = " << setw(12) << bigp;
+    cerr << "  error " << setw(12) << ((reference == 0) ? (mpreal)0.0 : abs(log(bigp/reference))) << endl;
+}
+
+/********
+* restart_xcrit() finds the smallest Xmax that fails the check for initial
+* entropy estimate hi, that is the smallest x with P(X >= x) < alpha. The tail
+* only shrinks as x grows, so every larger Xmax fails too and a count that
+* reaches xcrit decides the result without the rest of the matrix. The tail
+* is summed downwards from P(X = 1000) = p^1000 with the ratio of successive
+* terms, P(X = j-1) = P(X = j)*j/(1001-j)*(1-p)/p, at the same precision as
+* restart_tail(), escalating the same way if a partial sum lands close to
+* alpha. Returns 1001 if no Xmax fails.
+*/
+inline int restart_xcrit(double hi)
+{
+    using mpfr::mpreal;
+
+    int bits = RESTART_TAIL_BITS;
+    int close;
+    int xcrit;
+    int j;
+
+    for (;;) {
+        mpreal::set_default_prec(bits+restart_error_bits(1000));
+
+        mpreal alpha = RESTART_ALPHA;
+        mpreal small_p = pow((mpreal)2.0,(mpreal)-hi);
+        mpreal ratio = (((mpreal)1.0)-small_p)/small_p;
+        mpreal term = pow(small_p,(mpreal)1000);
+        mpreal tail = term;
+
+        close = restart_near_alpha(tail, bits);
+        xcrit = 1;
+        if ((small_p >= 1) || (tail >= alpha)) xcrit = 1001;
+        else {
+            for (j=1000;j>0;j--) {
+                term = term*j/(1001-j)*ratio;
+                tail += term;
+                close = close || restart_near_alpha(tail, bits);
+                if (tail >= alpha) {
+                    xcrit = j;
+                    break;
+                }
+            }
+        }
+        if (!close || (bits >= RESTART_MAX_BITS)) return xcrit;
+        bits = bits*2;
+        if (bits > RESTART_MAX_BITS) bits = RESTART_MAX_BITS;
+    }
+}
+
+/********
+* The p-value cache.
+*
+* A cache file holds P(X >= Xmax) for the (n, Xmax, H_I, alpha, engine)
+* combinations already worked out, so a check that has seen its Xmax and
+* H_I before only has to count the matrix. After a restart_cache_header
+* the file is fixed size records, only ever appended to with a single
+* write(), so several checkers can share one file. The header is written and
+* each record appended under flock(), and nothing is ever truncated. Each
+* record holds the verdict, P to the digits it is good to (40 for exact),
+* the engine and the precision it worked at, and a checksum, so a record
+* torn by a crash is left out. An append that finds one at the end first
+* pads it out to a whole record, which keeps the records after it in step.
+* restart_cache_open() maps the records read only and indexes them by key in
+* an open addressed table of record numbers, built in memory on each open.
+* A later record with the same key replaces an earlier one.
+*/
+#define RESTART_CACHE_MAGIC "RSTPVAL1"
+
+struct restart_cache_header {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct restart_cache_record {
+    int32_t n;                  // key: n, xmax, hi, alpha and engine
+    int32_t xmax;
+    double hi;
+    double alpha;
+    int32_t engine;             // RESTART_ENGINE_* asked for
+    int32_t used;               // index into restart_engine_names[] of the engine that computed it
+    int32_t bits;               // precision the engine worked at, 0 for exact
+    int32_t pass;
+    char bigp[80];              // P, to the decimal digits it is good to, 40 for exact
+    uint64_t check;             // FNV-1a of the record up to here
+};
+
+#define RESTART_CACHE_KEY_BYTES 28
+
+static_assert(sizeof(restart_cache_record) == 128, "restart_cache_record must be 128 bytes");
+
+struct restart_cache {
+    int fd;
+    const unsigned char *map;   // the file, read only
+    size_t map_len;
+    uint32_t *slots;            // record number+1, 0 for empty
+    uint32_t nslots;            // a power of 2
+};
+
+// The engine names restart_tail_engine() reports, by the number a record keeps.
+static const char *restart_engine_names[] = {"double", "long double", "MPFR", "MPFR incomplete beta", "exact rational"};
+
+inline uint64_t restart_fnv1a(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i=0;i<len;i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline void restart_cache_key(restart_cache_record *k, int n, int xmax, double hi, int engine)
+{
+    memset(k, 0, sizeof(*k));
+    k->n = n;
+    k->xmax = xmax;
+    k->hi = hi;
+    k->alpha = RESTART_ALPHA;
+    k->engine = engine;
+}
+
+inline const restart_cache_record *restart_cache_record_at(const restart_cache *cache, uint32_t i)
+{
+    return (const restart_cache_record *)(cache->map+sizeof(restart_cache_header)+(i*sizeof(restart_cache_record)));
+}
+
+/********
+* restart_cache_open() opens or creates the cache file filename and indexes
+* the records in it. Returns 0, or -1 if the file can't be opened or mapped or
+* is not a cache file.
+*/
+inline int restart_cache_open(restart_cache *cache, const char *filename)
+{
+    restart_cache_header header;
+    const restart_cache_record *rec;
+    struct stat st;
+    size_t records;
+    size_t whole;
+    uint32_t i;
+    uint32_t s;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (cache->fd < 0) return -1;
+
+    // Only the first checker to hold the lock on a new file writes the header.
+    if (flock(cache->fd, LOCK_EX) != 0) {
+        close(cache->fd);
+        return -1;
+    }
+    if ((fstat(cache->fd, &st) != 0)) {
+        close(cache->fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, RESTART_CACHE_MAGIC, 8);
+        header.record_size = sizeof(restart_cache_record);
+        if (write(cache->fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+            close(cache->fd);
+            return -1;
+        }
+        st.st_size = sizeof(header);
+    }
+    flock(cache->fd, LOCK_UN);
+    if ((size_t)st.st_size < sizeof(header)) {
+        close(cache->fd);
+        return -1;
+    }
+
+    // Only whole records are mapped. A part record at the end is left alone.
+    records = ((size_t)st.st_size-sizeof(header))/sizeof(restart_cache_record);
+    whole = sizeof(header)+(records*sizeof(restart_cache_record));
+
+    cache->map_len = whole;
+    cache->map = (const unsigned char *)mmap(NULL, whole, PROT_READ, MAP_SHARED, cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+        close(cache->fd);
+        return -1;
+    }
+    if ((memcmp(cache->map, RESTART_CACHE_MAGIC, 8) != 0) ||
+        (((const restart_cache_header *)cache->map)->record_size != sizeof(restart_cache_record))) {
+        munmap((void *)cache->map, cache->map_len);
+        close(cache->fd);
+        return -1;
+    }
+
+    cache->nslots = 16;
+    while (cache->nslots < (records*2)) cache->nslots *= 2;
+    cache->slots = (uint32_t *)calloc(cache->nslots, sizeof(uint32_t));
+    if (cache->slots == NULL) {
+        munmap((void *)cache->map, cache->map_len);
+        close(cache->fd);
+        return -1;
+    }
+
+    for (i=0;i<records;i++) {
+        rec = restart_cache_record_at(cache, i);
+        if (rec->check != restart_fnv1a(rec, offsetof(restart_cache_record, check))) continue;
+        if ((rec->used < 0) || (rec->used >= (int)(sizeof(restart_engine_names)/sizeof(restart_engine_names[0])))) continue;
+        s = (uint32_t)restart_fnv1a(rec, RESTART_CACHE_KEY_BYTES) & (cache->nslots-1);
+        while ((cache->slots[s] != 0) &&
+               (memcmp(restart_cache_record_at(cache, cache->slots[s]-1), rec, RESTART_CACHE_KEY_BYTES) != 0)) {
+            s = (s+1) & (cache->nslots-1);
+        }
+        cache->slots[s] = i+1;
+    }
+    return 0;
+}
+
+inline void restart_cache_close(restart_cache *cache)
+{
+    free(cache->slots);
+    munmap((void *)cache->map, cache->map_len);
+    close(cache->fd);
+}
+
+// The record for the key, or NULL.
+inline const restart_cache_record *restart_cache_find(const restart_cache *cache, int n, int xmax, double hi, int engine)
+{
+    restart_cache_record key;
+    const restart_cache_record *rec;
+    uint32_t s;
+
+    restart_cache_key(&key, n, xmax, hi, engine);
+    s = (uint32_t)restart_fnv1a(&key, RESTART_CACHE_KEY_BYTES) & (cache->nslots-1);
+    while (cache->slots[s] != 0) {
+        rec = restart_cache_record_at(cache, cache->slots[s]-1);
+        if (memcmp(rec, &key, RESTART_CACHE_KEY_BYTES) == 0) return rec;
+        s = (s+1) & (cache->nslots-1);
+    }
+    return NULL;
+}
+
+// Appends a record. It is seen by the next restart_cache_open(), not this
+// one. The mutex keeps threads sharing the descriptor, which flock() does
+// not tell apart, from padding the same part record twice.
+inline void restart_cache_add(restart_cache *cache, int n, int xmax, double hi, int engine, const char *name, const mpfr::mpreal &bigp, int pass)
+{
+    static std::mutex append;
+
+    restart_cache_record rec;
+    unsigned char pad[sizeof(restart_cache_record)];
+    char format[16];
+    struct stat st;
+    size_t part;
+    int digits;
+    int good;
+    int used;
+    int ok;
+
+    for (used=0;used<(int)(sizeof(restart_engine_names)/sizeof(restart_engine_names[0]));used++) {
+        if (strcmp(name, restart_engine_names[used]) == 0) break;
+    }
+    if (used == (int)(sizeof(restart_engine_names)/sizeof(restart_engine_names[0]))) return;
+
+    restart_cache_key(&rec, n, xmax, hi, engine);
+    rec.used = used;
+    // The MPFR engines work at the precision of their result. The float
+    // engines only give it from a double or long double.
+    if (strcmp(name, "double") == 0) rec.bits = std::numeric_limits<double>::digits;
+    else if (strcmp(name, "long double") == 0) rec.bits = std::numeric_limits<long double>::digits;
+    else if (strcmp(name, "exact rational") == 0) rec.bits = 0;
+    else rec.bits = (int32_t)bigp.get_prec();
+    rec.pass = pass;
+    // P only keeps the decimal digits it is good to: the precision the engine
+    // worked at, less the bits its sum can lose (twice that for the beta sum).
+    if (rec.bits == 0) digits = RESTART_EXACT_DIGITS;
+    else {
+        good = rec.bits-restart_error_bits(n);
+        if (strcmp(name, "MPFR incomplete beta") == 0) good -= restart_error_bits(n);
+        digits = (int)floor(good*log10(2.0));
+        if (digits < 1) digits = 1;
+        if (digits > RESTART_EXACT_DIGITS) digits = RESTART_EXACT_DIGITS;
+    }
+    snprintf(format, sizeof(format), "%%.%dRe", digits-1);
+    snprintf(rec.bigp, sizeof(rec.bigp), "%s", bigp.toString(format).c_str());
+    rec.check = restart_fnv1a(&rec, offsetof(restart_cache_record, check));
+    memset(pad, 0, sizeof(pad));
+
+    // A failed write just leaves the value out of the cache.
+    std::lock_guard<std::mutex> guard(append);
+    if (flock(cache->fd, LOCK_EX) != 0) return;
+    ok = (fstat(cache->fd, &st) == 0);
+    if (ok) {
+        part = ((size_t)st.st_size-sizeof(restart_cache_header)) % sizeof(restart_cache_record);
+        if (part != 0) ok = (write(cache->fd, pad, sizeof(pad)-part) == (ssize_t)(sizeof(pad)-part));
+    }
+    if (ok) ok = (write(cache->fd, &rec, sizeof(rec)) == (ssize_t)sizeof(rec));
+    flock(cache->fd, LOCK_UN);
+}
+
+/********
+* restart_tail_cached() is restart_tail_engine() through cache: P(X >= xmax)
+* and the verdict come from the cache if it has them, else they are computed
+* and added to it. A NULL cache just computes.
+*/
+inline mpfr::mpreal restart_tail_cached(restart_cache *cache, int n, int xmax, double hi, int engine, int jobs, int verbose, const char **name, int *pass)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+
+    const restart_cache_record *rec;
+
+    if (cache == NULL) return restart_tail_engine(n, xmax, hi, engine, jobs, verbose, name, pass);
+
+    rec = restart_cache_find(cache, n, xmax, hi, engine);
+    if (rec != NULL) {
+        *name = restart_engine_names[rec->used];
+        *pass = rec->pass;
+        if (verbose) {
+            cerr << "P(X >= Xmax) from the cache, computed by the " << *name << " engine ";
+            if (rec->bits == 0) cerr << "exactly" << endl;
+            else cerr << "at " << rec->bits << " bits" << endl;
+        }
+        mpreal::set_default_prec(RESTART_TAIL_BITS+restart_error_bits(n));
+        return mpreal(rec->bigp);
+    }
+
+    mpreal bigp = restart_tail_engine(n, xmax, hi, engine, jobs, verbose, name, pass);
+    restart_cache_add(cache, n, xmax, hi, engine, *name, bigp, *pass);
+    return bigp;
+}
+
+/********
+* restart_max_hi() is the inverse of the check: the largest initial entropy
+* estimate that n trials with maximum count xmax support, sup{H_I : P(X >=
+* xmax) >= alpha}. P falls as H_I rises, so the H_I that pass are an
+* interval from 0 and this bisects on the verdict of engine. The upper end
+* doubles from 1 until it fails, then the interval halves until it is
+* narrower than RESTART_INVERSE_TOL. Away from the boundary the tiered
+* engine decides each step in microseconds with hardware floats, so only the
+* last few steps need MPFR. Returns the largest H_I seen to pass, infinity
+* if xmax is 0 and every H_I passes, or -1 if xmax > n and none does.
+*/
+#define RESTART_INVERSE_TOL 1e-9
+
+inline double restart_max_hi(int n, int xmax, int engine, int jobs, int verbose)
+{
+    using std::cerr;
+    using std::endl;
+
+    const char *name;
+    double lo = 0.0;
+    double hi = 1.0;
+    double mid;
+    int pass;
+
+    if (xmax <= 0) return std::numeric_limits<double>::infinity();
+    if (xmax > n) return -1.0;
+
+    for (;;) {
+        restart_tail_engine(n, xmax, hi, engine, jobs, 0, &name, &pass);
+        if (verbose) cerr << "H_I = " << hi << (pass ? " passes" : " fails") << endl;
+        if (!pass) break;
+        lo = hi;
+        hi = hi*2;
+    }
+
+    while ((hi-lo) > RESTART_INVERSE_TOL) {
+        mid = lo+(hi-lo)/2;
+        restart_tail_engine(n, xmax, mid, engine, jobs, 0, &name, &pass);
+        if (verbose) cerr << "H_I = " << std::setprecision(12) << mid << (pass ? " passes" : " fails") << " (" << name << ")" << std::setprecision(6) << endl;
+        if (pass) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/********
+* Batches of H_I.
+*
+* restart_tail_batch() evaluates P(X >= xmax) and the verdict for count
+* values of H_I at once, for a sweep over H_I from one count of the matrix.
+* Xmax does not depend on H_I, and the log-factorials the float engines need
+* are the shared restart_log_factorial() tables, so the values are
+* independent and are shared out between jobs threads, each going through
+* cache if it is not NULL. Each value goes to its own slot, so the results
+* do not depend on the number of threads.
+*/
+struct restart_tail_batch_work {
+    int n;
+    int xmax;
+    int engine;
+    int count;
+    restart_cache *cache;       // or NULL
+    const double *his;          // [count] H_I values
+    mpfr::mpreal *bigp;         // [count] P(X >= xmax)
+    int *pass;                  // [count] verdicts
+    std::atomic<int> next;      // next value to take
+};
+
+inline void restart_tail_batch_worker(restart_tail_batch_work *w)
+{
+    const char *name;
+    int i;
+
+    while ((i = w->next.fetch_add(1)) < w->count) {
+        w->bigp[i] = restart_tail_cached(w->cache, w->n, w->xmax, w->his[i], w->engine, 1, 0, &name, &w->pass[i]);
+    }
+    mpfr_free_cache();
+}
+
+inline void restart_tail_batch(restart_cache *cache, int n, int xmax, const double *his, int count, int engine, int jobs, mpfr::mpreal *bigp, int *pass)
+{
+    restart_tail_batch_work w;
+    std::thread *workers;
+    int t;
+
+    w.n = n;
+    w.xmax = xmax;
+    w.engine = engine;
+    w.count = count;
+    w.cache = cache;
+    w.his = his;
+    w.bigp = bigp;
+    w.pass = pass;
+    w.next = 0;
+
+    if (jobs > count) jobs = count;
+    if (jobs <= 1) {
+        restart_tail_batch_worker(&w);
+        return;
+    }
+    workers = new std::thread[jobs];
+    for (t=0;t<jobs;t++) workers[t] = std::thread(restart_tail_batch_worker, &w);
+    for (t=0;t<jobs;t++) workers[t].join();
+    delete[] workers;
+}
+
+/********
+* restart_maxima() sets the bits per symbol, the row and column maxima and
+* Xmax of r from the counts, which do not depend on H_I.
+*/
+inline void restart_maxima(const restart_counts *c, restart_result *r)
+{
+    r->bps = restart_bps(c->bigor);
+    r->row_max_max = c->row_max_max;
+    r->column_max_max = restart_column_max_max(c);
+
+    if (r->column_max_max > r->row_max_max) r->xmax = r->column_max_max;
+    else r->xmax = r->row_max_max;
+}
+
+/********
+* restart_finish() completes the restart sanity check from the counts of all
+* 1000 rows, with initial entropy estimate hi. If counting stopped early at
+* c->stop_at, the check has failed and the maxima are lower bounds, so the
+* tail isn't summed. Otherwise it goes through cache, which may be NULL.
+*/
+inline void restart_finish(const restart_counts *c, double hi, int engine, restart_cache *cache, int verbose, restart_result *r)
+{
+    using mpfr::mpreal;
+    using std::cerr;
+    using std::endl;
+
+    r->hi = hi;
+    restart_maxima(c, r);
+
+    r->small_p = pow((mpreal)2.0,(mpreal)-hi);
+    r->xcrit = c->stop_at;
+    r->early = ((c->stop_at > 0) && (c->rows < 1000)) ? 1 : 0;
+    r->rows = c->rows;
+
+    if (r->early) {
+        if (verbose) cerr << "Stopped counting after " << c->rows << " rows, Xmax reached x_crit = " << c->stop_at << endl;
+        r->engine = "none";
+        r->bigp = 0.0;
+        r->pass = 0;
+        return;
+    }
+
+    if (verbose) cerr << "Computing P(X <= Xmax)." << endl;
+
+    r->bigp = restart_tail_cached(cache, 1000, r->xmax, hi, engine, 1, verbose, &r->engine, &r->pass);
+    if (verbose) cerr << "P(X >= Xmax) computed with the " << r->engine << " engine." << endl;
+}
+
+/********
+* restart_check() runs the restart sanity check on a complete 1000x1000 matrix
+* of one symbol per byte, counting with jobs threads. Unless full is set,
+* counting stops as soon as the matrix is known to fail. Returns 0, or -1 if
+* the counts can't be allocated.
+*/
+inline int restart_check(const unsigned char *matrix, double hi, int jobs, int full, int verbose, restart_result *r)
+{
+    using std::cerr;
+    using std::endl;
+
+    restart_counts c;
+
+    if (restart_counts_init(&c) != 0) return -1;
+    if (full == 0) c.stop_at = restart_xcrit(hi);
+
+    if (verbose) cerr << "Counting row and columns symbols maximums." << endl;
+
+    if (restart_count_matrix(&c, matrix, jobs) != 0) {
+        restart_counts_free(&c);
+        return -1;
+    }
+    restart_finish(&c, hi, RESTART_ENGINE_TIERED, NULL, verbose, r);
+    restart_counts_free(&c);
+    return 0;
+}
+
+inline void print_restart_result(const restart_result *r)
+{
+    using std::cerr;
+    using std::endl;
+    using std::setw;
+
+    cerr << endl;
+    cerr << "    ---- Results -----" << endl;
+    if (r->early == 0) cerr << setw(18) << "Bits per symbol = "<< setw(8) << r->bps << endl;
+    cerr << setw(18) << "H_I = "            << setw(8) << r->hi << endl;
+    cerr << setw(18) << "alpha = "          << setw(8) << "0.000005" << endl;
+    cerr << setw(18) << "p = "              << setw(8) << r->small_p << endl;
+    if (r->early) {
+        // The rest of the matrix wasn't counted, so its maxima aren't known.
+        cerr << "Counting stopped at row " << r->rows << " because a count reached x_crit" << endl;
+        cerr << setw(18) << "x_crit = "         << setw(8) << r->xcrit << endl;
+        cerr << setw(18) << "count = "          << setw(8) << r->xmax << endl;
+        cerr << setw(18) << "P(x => count) < "  << setw(8) << "0.000005" << endl;
+    } else {
+        cerr << setw(18) << "row_max_max = "    << setw(8) << r->row_max_max << endl;
+        cerr << setw(18) << "column_max_max = " << setw(8) << r->column_max_max << endl;
+        cerr << setw(18) << "Xmax = "           << setw(8) << r->xmax << endl;
+        cerr << setw(18) << "P(x => xmax) = "   << setw(8) << r->bigp << endl;
+    }
+
+    if (r->pass == 0) cerr << setw(18) << "Result = " << setw(8) << "FAIL" << endl;
+    else cerr << setw(18) << "Result = " << setw(8) << "PASS" << endl;
+}
+
+/********
+* The result cache.
+*
+* restart_hash128() is a 128 bit hash of a whole matrix, fast enough that
+* hashing costs a small part of counting. Like XXH3 it keeps four 64 bit
+* lanes and for each 32 byte stripe adds the product of the two 32 bit
+* halves of each word xor a secret, and the word from the next lane. The
+* lanes are scrambled every 16 stripes and mixed down to two words at the
+* end. That is one vector instruction of each kind per stripe with AVX2.
+* It is not a cryptographic hash, only a key for results of unchanged
+* matrices.
+*
+* A result is a small text file in a results directory, named by the hash
+* of the matrix hash, H_I, alpha, the engine, -f and RESTART_RESULT_VERSION.
+* The first line is the whole key, and a file whose first line does not
+* match is ignored. Bump RESTART_RESULT_VERSION when a change to the
+* counting or the engines could change a result.
+*/
+#define RESTART_RESULT_VERSION 1
+
+static const uint64_t restart_hash_secret[4] = {0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL};
+static const uint64_t restart_hash_scramble[4] = {0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL};
+
+// Swapping the words of each pair of lanes needs a compiler specific builtin.
+// Without one, restart_hash_stripes() works a lane at a time to the same hash.
+#if defined(__clang__)
+#define RESTART_SWAP_PAIRS(v) __builtin_shufflevector(v, v, 1, 0, 3, 2)
+#elif defined(__GNUC__)
+#define RESTART_SWAP_PAIRS(v) __builtin_shuffle(v, (restart_v4u64){1, 0, 3, 2})
+#endif
+
+#ifdef RESTART_SWAP_PAIRS
+typedef uint64_t restart_v4u64 __attribute__((vector_size(32)));
+
+RESTART_TARGET_CLONES
+inline void restart_hash_stripes(uint64_t acc[4], const unsigned char *data, size_t stripes)
+{
+    const restart_v4u64 low = {0xffffffffULL, 0xffffffffULL, 0xffffffffULL, 0xffffffffULL};
+    restart_v4u64 secret;
+    restart_v4u64 scramble;
+    restart_v4u64 a;
+    restart_v4u64 v;
+    restart_v4u64 dk;
+    size_t s;
+
+    memcpy(&secret, restart_hash_secret, 32);
+    memcpy(&scramble, restart_hash_scramble, 32);
+    memcpy(&a, acc, 32);
+    for (s=0;s<stripes;s++) {
+        memcpy(&v, data+(s*32), 32);
+        dk = v ^ secret;
+        a += (dk & low)*(dk >> 32);
+        a += RESTART_SWAP_PAIRS(v);
+        if ((s % 16) == 15) {
+            a ^= a >> 47;
+            a ^= scramble;
+            a *= 0x9e3779b1ULL;
+        }
+    }
+    memcpy(acc, &a, 32);
+}
+#else
+inline void restart_hash_stripes(uint64_t acc[4], const unsigned char *data, size_t stripes)
+{
+    uint64_t v[4];
+    uint64_t dk;
+    size_t s;
+    int i;
+
+    for (s=0;s<stripes;s++) {
+        memcpy(v, data+(s*32), 32);
+        for (i=0;i<4;i++) {
+            dk = v[i] ^ restart_hash_secret[i];
+            acc[i] += (dk & 0xffffffffULL)*(dk >> 32);
+            acc[i] += v[i^1];
+        }
+        if ((s % 16) == 15) {
+            for (i=0;i<4;i++) {
+                acc[i] ^= acc[i] >> 47;
+                acc[i] ^= restart_hash_scramble[i];
+                acc[i] *= 0x9e3779b1ULL;
+            }
+        }
+    }
+}
+#endif
+
+inline uint64_t restart_mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+inline void restart_hash128(const void *data, size_t len, uint64_t out[2])
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t acc[4] = {0xc2b2ae3d27d4eb4fULL, 0x9e3779b185ebca87ULL, 0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL};
+    unsigned char last[32];
+    size_t stripes = len/32;
+    int i;
+
+    restart_hash_stripes(acc, p, stripes);
+    memset(last, 0, sizeof(last));
+    memcpy(last, p+(stripes*32), len-(stripes*32));
+    restart_hash_stripes(acc, last, 1);
+
+    out[0] = len*0x9e3779b185ebca87ULL;
+    out[1] = ~out[0];
+    for (i=0;i<4;i++) {
+        out[0] = restart_mix64(out[0] ^ acc[i]);
+        out[1] = restart_mix64(out[1]+acc[i]+(uint64_t)i);
+    }
+}
+
+// The engine name as the static string restart_tail_engine() or restart_finish() uses, or NULL.
+inline const char *restart_engine_name(const char *name)
+{
+    size_t i;
+
+    for (i=0;i<(sizeof(restart_engine_names)/sizeof(restart_engine_names[0]));i++) {
+        if (strcmp(name, restart_engine_names[i]) == 0) return restart_engine_names[i];
+    }
+    if (strcmp(name, "none") == 0) return "none";
+    return NULL;
+}
+
+/********
+* restart_result_key() sets the key line for a check of a matrix with hash
+* matrix_hash and the file name it goes in within directory dir.
+*/
+inline void restart_result_key(const uint64_t matrix_hash[2], double hi, int engine, int full, const char *dir,
+                               char *key, size_t key_len, char *path, size_t path_len)
+{
+    uint64_t h[2];
+
+    snprintf(key, key_len, "restart_result %d H_I=%a alpha=%a engine=%d full=%d matrix=%016llx%016llx",
+             RESTART_RESULT_VERSION, hi, (double)RESTART_ALPHA, engine, full,
+             (unsigned long long)matrix_hash[0], (unsigned long long)matrix_hash[1]);
+    restart_hash128(key, strlen(key), h);
+    snprintf(path, path_len, "%s/%016llx%016llx.result", dir, (unsigned long long)h[0], (unsigned long long)h[1]);
+}
+
+/********
+* restart_result_read() loads the result with key from path. Returns 0, or
+* -1 if there is no such result.
+*/
+inline int restart_result_read(const char *path, const char *key, double hi, restart_result *r)
+{
+    using mpfr::mpreal;
+
+    FILE *fp;
+    char line[1024];
+    char bigp[128];
+    char name[64];
+    int ok;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+    ok = (fgets(line, sizeof(line), fp) != NULL);
+    if (ok) {
+        line[strcspn(line, "\n")] = 0;
+        ok = (strcmp(line, key) == 0);
+    }
+    if (ok) {
+        ok = (fscanf(fp, "bps=%d row_max_max=%d column_max_max=%d xmax=%d xcrit=%d early=%d rows=%d pass=%d P=%127s engine=%63[^\n]",
+                     &r->bps, &r->row_max_max, &r->column_max_max, &r->xmax, &r->xcrit, &r->early, &r->rows, &r->pass, bigp, name) == 10);
+    }
+    fclose(fp);
+    if (!ok) return -1;
+
+    r->engine = restart_engine_name(name);
+    if (r->engine == NULL) return -1;
+    mpreal::set_default_prec(RESTART_TAIL_BITS+restart_error_bits(1000));
+    r->hi = hi;
+    r->small_p = pow((mpreal)2.0,(mpreal)-hi);
+    r->bigp = mpreal(bigp);
+    return 0;
+}
+
+/********
+* restart_result_write() saves r under key at path. It is written to a
+* temporary file and renamed into place, so a reader sees all of it or
+* none. Returns 0, or -1 if it can't be written.
+*/
+inline int restart_result_write(const char *path, const char *key, const restart_result *r)
+{
+    FILE *fp;
+    char tmp[8300];
+    int ok;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    fp = fopen(tmp, "w");
+    if (fp == NULL) return -1;
+    fprintf(fp, "%s\n", key);
+    fprintf(fp, "bps=%d row_max_max=%d column_max_max=%d xmax=%d xcrit=%d early=%d rows=%d pass=%d P=%s engine=%s\n",
+            r->bps, r->row_max_max, r->column_max_max, r->xmax, r->xcrit, r->early, r->rows, r->pass,
+            r->bigp.toString("%.40Re").c_str(), r->engine);
+    ok = (fclose(fp) == 0);
+    if (ok) ok = (rename(tmp, path) == 0);
+    if (!ok) remove(tmp);
+    return ok ? 0 : -1;
+}
+
+#endif
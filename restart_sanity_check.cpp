@@ -47,11 +47,27 @@
 #include "mpreal.h"
 #include <iostream>
 #include <iomanip>
+#include "restart_check.h"
 
 using mpfr::mpreal;
 void display_usage() {
-fprintf(stderr,"Usage: restart_sanity_checker -e <H_I> <filename>\n");
-fprintf(stderr,"       -e , --H_I              Output Initial Entropy Estimate\n");
+fprintf(stderr,"Usage: restart_sanity_checker -e <H_I> [-j <jobs>] [-f] [-a] [-I] [-E <engine>|-X] [-C <cache>] [-R <dir>] <filename or - for stdin>\n");
+fprintf(stderr,"       restart_sanity_checker -e <H_I> [-n <n>] -x <Xmax> [-a] [-I] [-E <engine>|-X] [-C <cache>]\n");
+fprintf(stderr,"       restart_sanity_checker -T <step>\n");
+fprintf(stderr,"       -e , --H_I              Output Initial Entropy Estimate. A list a,b,c or range a:b:step, or a mix, prints a CSV\n");
+fprintf(stderr,"                               of H_I,P,p,Result with one line per H_I from one count of the matrix\n");
+fprintf(stderr,"       -j , --jobs <n>         Count rows, or sum a large -n tail, with n worker threads (0 = all cores) (default 1)\n");
+fprintf(stderr,"       -f , --full             Count the whole matrix and compute P(X >= Xmax) even once it is known to fail\n");
+fprintf(stderr,"       -a , --audit            Compute P(X >= Xmax) with every engine and report how far apart they are\n");
+fprintf(stderr,"       -E , --engine <engine>  How P(X >= Xmax) is computed: tiered (default), sum, beta or exact\n");
+fprintf(stderr,"       -X , --exact            Same as -E exact, P(X >= Xmax) as an exact rational for a dyadic p (implies -f)\n");
+fprintf(stderr,"       -C , --cache <file>     Look P(X >= Xmax) up in, and add it to, an append only cache file\n");
+fprintf(stderr,"       -R , --results <dir>    Keep whole results in dir by a hash of the matrix and options, and print a\n");
+fprintf(stderr,"                               stored result without counting when the same check is run again\n");
+fprintf(stderr,"       -n , --trials <n>       Number of trials for -x (default 1000)\n");
+fprintf(stderr,"       -x , --xmax <Xmax>      Compute P(X >= Xmax) for X ~ Binomial(n, 2^-H_I) directly, without a matrix\n");
+fprintf(stderr,"       -I , --inverse          Also find the largest H_I that Xmax passes with (implies -f)\n");
+fprintf(stderr,"       -T , --table <step>     Print the x_crit that fails the check for each H_I from step to 8 in steps of step\n");
 fprintf(stderr,"       -v , --verbose          Output information to stderr\n");
 fprintf(stderr,"       -h , --help             Output this information\n");
 fprintf(stderr,"\n");
@@ -60,16 +76,96 @@ fprintf(stderr,"  Author: David Johnston, dj@deadhat.com\n");
 fprintf(stderr,"\n");
 }
 
-// n Choose k algorithm
-mpreal choose(mpreal n,mpreal k){
+/********
+* check_hi() exits if an H_I is outside 0 to RESTART_MAX_HI.
+*/
+void check_hi(double hi) {
+    if (!((hi >= 0.0) && (hi <= RESTART_MAX_HI))) {
+        fprintf(stderr,"Error, H_I must be between 0 and %g, got %g\n", RESTART_MAX_HI, hi);
+        exit(-1);
+    }
+}
+
+/********
+* parse_hi_list() reads a comma separated list of H_I values and a:b:step
+* ranges into a new array and returns how many there are.
+*/
+int parse_hi_list(const char *list, double **his) {
+    char *copy;
+    char *item;
+    char *save;
+    double a;
+    double b;
+    double step;
+    int steps;
+    int count = 0;
+    int i;
+
+    *his = NULL;
+    copy = strdup(list);
+    for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (strchr(item, ':') == NULL) {
+            a = atof(item);
+            b = a;
+            step = 1.0;
+        } else if ((sscanf(item, "%lf:%lf:%lf", &a, &b, &step) != 3) || (step <= 0.0) || (b < a)) {
+            fprintf(stderr,"Error, H_I range %s must be a:b:step with a <= b and step > 0\n", item);
+            exit(-1);
+        }
+        steps = (int)floor(((b-a)/step)+1e-9)+1;
+        if ((count+steps) > 1000000) {
+            fprintf(stderr,"Error, more than 1000000 H_I values\n");
+            exit(-1);
+        }
+        *his = (double *)realloc(*his, (count+steps)*sizeof(double));
+        if (*his == NULL) {
+            fprintf(stderr,"Error, failed to allocate the H_I values\n");
+            exit(-1);
+        }
+        for (i=0;i<steps;i++) {
+            (*his)[count] = a+(i*step);
+            check_hi((*his)[count++]);
+        }
+    }
+    free(copy);
+    if (count == 0) {
+        fprintf(stderr,"Error, no H_I values in %s\n", list);
+        exit(-1);
+    }
+    return count;
+}
+
+/********
+* print_hi_batch() prints P(X >= xmax) and the verdict for each H_I in his
+* as CSV on stdout, in the order given, through cache if it is not NULL.
+*/
+void print_hi_batch(restart_cache *cache, int n, int xmax, const double *his, int count, int engine, int jobs) {
+    mpreal *bigp = new mpreal[count];
+    int *pass = new int[count];
+    int i;
+
+    restart_tail_batch(cache, n, xmax, his, count, engine, jobs, bigp, pass);
 
-    uint64_t i;
-    //uint64_t prod = 1;
-    mpreal prod = 1.0;
-    for (i=1;i<=k;i++) {
-        prod = prod * ((n-(k-i))/i);
+    mpreal::set_default_prec(RESTART_TAIL_BITS);
+    printf("H_I,P,p,Result\n");
+    for (i=0;i<count;i++) {
+        printf("%g,%s,%s,%s\n", his[i], bigp[i].toString("%.10Re").c_str(),
+               pow((mpreal)2.0,(mpreal)-his[i]).toString("%.10Re").c_str(), pass[i] ? "PASS" : "FAIL");
     }
-    return prod;
+    delete[] bigp;
+    delete[] pass;
+}
+
+/********
+* print_max_hi() adds the result of restart_max_hi() to the results.
+*/
+void print_max_hi(double max_hi) {
+    using std::cerr;
+    using std::endl;
+    using std::setw;
+
+    if (max_hi < 0) cerr << setw(18) << "max H_I = " << setw(8) << "none" << endl;
+    else cerr << setw(18) << "max H_I = " << setw(8) << std::setprecision(9) << max_hi << std::setprecision(6) << endl;
 }
 
 /********
@@ -84,23 +180,21 @@ int main(int argc, char** argv)
     using std::endl;
     using std::setw;
 
-    unsigned char buffer[1000008];
+    unsigned char buffer[RESTART_ROW_BLOCK*1000];
+    unsigned char *matrix = NULL;
 
     size_t len;
     unsigned char abit;
 
     int i;
-    int j;
 
     int opt;
-    unsigned char matrix[1000][1000];
 
     FILE *ifp;
     
     char filename[8192];
     
     int bps = 1;   
-    int abyte;
     
     int littleendian=1;
     int gotL=0;
@@ -122,13 +216,40 @@ int main(int argc, char** argv)
     int amount;
 
     double hi = 0.8;
+    double *his = NULL;
+    int nhis = 0;
+    int jobs = 1;
+    int full = 0;
+    int audit = 0;
+    int engine = RESTART_ENGINE_TIERED;
+    int trials = 1000;
+    int xmax = -1;
+    int inverse = 0;
+    double table_step = 0.0;
+    const char *cache_filename = NULL;
+    restart_cache cache;
+    restart_cache *cachep = NULL;
+    const char *results_dir = NULL;
+    char result_key[256];
+    char result_path[8300];
 
     //printf("choose(1000,849) = %f\n",choose(1000,849));
     //exit(1);
 
-    char optString[] = "e:vh";
+    char optString[] = "e:j:faE:XC:R:n:x:IT:vh";
     static const struct option longOpts[] = {
     { "H_I", required_argument, NULL, 'e' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "full", no_argument, NULL, 'f' },
+    { "audit", no_argument, NULL, 'a' },
+    { "engine", required_argument, NULL, 'E' },
+    { "exact", no_argument, NULL, 'X' },
+    { "cache", required_argument, NULL, 'C' },
+    { "results", required_argument, NULL, 'R' },
+    { "trials", required_argument, NULL, 'n' },
+    { "xmax", required_argument, NULL, 'x' },
+    { "inverse", no_argument, NULL, 'I' },
+    { "table", required_argument, NULL, 'T' },
     { "verbose", no_argument, NULL, 'v' },
     { "help", no_argument, NULL, 'h' },
     { NULL, no_argument, NULL, 0 }
@@ -138,7 +259,72 @@ int main(int argc, char** argv)
     while( opt != -1 ) {
         switch( opt ) {
             case 'e':
-                hi = atof(optarg);
+                free(his);
+                his = NULL;
+                nhis = 0;
+                if (strpbrk(optarg, ",:") == NULL) {
+                    hi = atof(optarg);
+                    check_hi(hi);
+                } else {
+                    nhis = parse_hi_list(optarg, &his);
+                    hi = his[0];
+                }
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 0) {
+                    fprintf(stderr,"Error, jobs must be positive\n");
+                    exit(-1);
+                }
+                break;
+            case 'f':
+                full = 1;
+                break;
+            case 'a':
+                audit = 1;
+                break;
+            case 'E':
+                if (strcmp(optarg,"tiered") == 0) engine = RESTART_ENGINE_TIERED;
+                else if (strcmp(optarg,"sum") == 0) engine = RESTART_ENGINE_SUM;
+                else if (strcmp(optarg,"beta") == 0) engine = RESTART_ENGINE_BETA;
+                else if (strcmp(optarg,"exact") == 0) engine = RESTART_ENGINE_EXACT;
+                else {
+                    fprintf(stderr,"Error, engine must be tiered, sum, beta or exact\n");
+                    exit(-1);
+                }
+                break;
+            case 'X':
+                engine = RESTART_ENGINE_EXACT;
+                break;
+            case 'C':
+                cache_filename = optarg;
+                break;
+            case 'R':
+                results_dir = optarg;
+                break;
+            case 'n':
+                trials = atoi(optarg);
+                if (trials < 1) {
+                    fprintf(stderr,"Error, trials must be at least 1\n");
+                    exit(-1);
+                }
+                break;
+            case 'x':
+                xmax = atoi(optarg);
+                if (xmax < 0) {
+                    fprintf(stderr,"Error, Xmax must be positive\n");
+                    exit(-1);
+                }
+                break;
+            case 'I':
+                inverse = 1;
+                break;
+            case 'T':
+                table_step = atof(optarg);
+                if ((table_step <= 0.0) || (table_step > 8.0)) {
+                    fprintf(stderr,"Error, table step must be between 0 and 8\n");
+                    exit(-1);
+                }
                 break;
             case 'v':
                 verbose=1;
@@ -176,6 +362,62 @@ int main(int argc, char** argv)
     }
     
 
+    if (jobs == 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+
+    if ((nhis > 0) && (audit || inverse)) {
+        fprintf(stderr,"Error, -a and -I take a single H_I\n");
+        exit(-1);
+    }
+    if ((results_dir != NULL) && ((nhis > 0) || audit || inverse || (xmax >= 0) || (table_step > 0.0))) {
+        fprintf(stderr,"Error, -R keeps the result of a single H_I check of a matrix, not -a, -I, -x, -T or a list of H_I\n");
+        exit(-1);
+    }
+
+    // With -T print x_crit on a grid of H_I. The check fails when Xmax >= x_crit,
+    // and 1001 means no Xmax fails.
+    if (table_step > 0.0) {
+        printf("H_I,x_crit\n");
+        for (i=1;(i*table_step) <= (8.0+1e-9);i++) {
+            printf("%g,%d\n", i*table_step, restart_xcrit(i*table_step));
+        }
+        exit(0);
+    }
+
+    if (cache_filename != NULL) {
+        if (restart_cache_open(&cache, cache_filename) != 0) {
+            cerr << "ERROR: Failed to open cache file " << cache_filename << endl;
+            exit(-1);
+        }
+        cachep = &cache;
+    }
+
+    // With -x there is no matrix, just the tail for the given n and Xmax.
+    if ((xmax >= 0) && (nhis > 0)) {
+        print_hi_batch(cachep, trials, xmax, his, nhis, engine, jobs);
+        exit(0);
+    }
+    if (xmax >= 0) {
+        const char *engine_name;
+        int pass;
+        mpreal bigp = restart_tail_cached(cachep, trials, xmax, hi, engine, jobs, verbose, &engine_name, &pass);
+
+        cerr << endl;
+        cerr << "    ---- Results -----" << endl;
+        cerr << setw(18) << "n = "            << setw(8) << trials << endl;
+        cerr << setw(18) << "H_I = "          << setw(8) << hi << endl;
+        cerr << setw(18) << "alpha = "        << setw(8) << "0.000005" << endl;
+        cerr << setw(18) << "p = "            << setw(8) << pow((mpreal)2.0,(mpreal)-hi) << endl;
+        cerr << setw(18) << "Xmax = "         << setw(8) << xmax << endl;
+        cerr << setw(18) << "P(x => xmax) = " << setw(8) << bigp << endl;
+        cerr << setw(18) << "Engine = "       << setw(8) << engine_name << endl;
+        if (pass == 0) cerr << setw(18) << "Result = " << setw(8) << "FAIL" << endl;
+        else cerr << setw(18) << "Result = " << setw(8) << "PASS" << endl;
+        if (inverse) print_max_hi(restart_max_hi(trials, xmax, engine, jobs, verbose));
+        if (audit) restart_tail_audit(trials, xmax, hi);
+        exit(0);
+    }
+
     /* find the input files */
     if (using_infile==0)
     {
@@ -184,7 +426,11 @@ int main(int argc, char** argv)
     }
 
 
-    ifp =  fopen(filename, "rb");
+    if (strcmp(filename,"-") == 0) {
+        ifp = stdin;
+    } else {
+        ifp =  fopen(filename, "rb");
+    }
             
     if (ifp == NULL) {
         cerr << "ERROR: Filed to open input file " << filename << " for reading" << endl;
@@ -192,9 +438,55 @@ int main(int argc, char** argv)
     }
 
 
-    // Read file
+    // A regular file is read whole and counted by restart_count_matrix(),
+    // with the kernel for its bits per symbol and split between the threads.
+    // So is any input with -R, where the matrix is hashed first. With one
+    // job, a pipe or FIFO is read RESTART_ROW_BLOCK rows at a time and each
+    // block is counted as it arrives, so counting overlaps with a slicer
+    // writing into it.
+    // Either way counting stops once a row or column reaches x_crit, but the
+    // rest of the input is still read.
+    restart_counts counts;
+    if (restart_counts_init(&counts) != 0) {
+        cerr << "ERROR: Failed to allocate the symbol counts" << endl;
+        exit(-1);
+    }
+    // An audit, the inverse or a batch of H_I needs the exact Xmax. So does
+    // the exact engine, as x_crit is found in floating point.
+    if ((full == 0) && (audit == 0) && (inverse == 0) && (nhis == 0) && (engine != RESTART_ENGINE_EXACT)) {
+        counts.stop_at = restart_xcrit(hi);
+        if (verbose) cerr << "x_crit = " << counts.stop_at << endl;
+    }
+
+    if (verbose) cerr << "Counting row and columns symbols maximums." << endl;
+
+    struct stat st;
+    int streaming = (jobs == 1) && (results_dir == NULL) &&
+                    !((fstat(fileno(ifp), &st) == 0) && S_ISREG(st.st_mode));
+
     amount = 1000000;
-    len = fread(buffer, 1, (size_t)amount , ifp);
+    len = 0;
+    if (streaming) {
+        int stopped = 0;
+        int nrows;
+        for (i=0;i<1000;i+=nrows) {
+            nrows = 1000-i;
+            if (nrows > RESTART_ROW_BLOCK) nrows = RESTART_ROW_BLOCK;
+            size_t got = fread(buffer, 1, nrows*1000, ifp);
+            len += got;
+            if (got != (size_t)(nrows*1000)) break;
+            if (stopped) continue;
+            restart_count_rows(&counts, buffer, nrows);
+            if (((i+nrows) % RESTART_STOP_ROWS) == 0) stopped = restart_counts_reached(&counts);
+        }
+    } else {
+        matrix = (unsigned char *)malloc(amount);
+        if (matrix == NULL) {
+            cerr << "ERROR: Failed to allocate the restart matrix" << endl;
+            exit(-1);
+        }
+        len = fread(matrix, 1, amount, ifp);
+    }
     if (verbose) cerr <<"read " << len << "/" << amount <<  " symbols from " << filename << endl;
         
     if (len != amount) {
@@ -202,135 +494,48 @@ int main(int argc, char** argv)
         exit(-1);
     }
 
-    fclose(ifp);
-
-    // Find bits per symbol
-    unsigned char bigor = 0;
-    for (i=0;i<1000000;i++) {
-        bigor = bigor | buffer[i];
+    restart_result result;
+    if (results_dir != NULL) {
+        uint64_t matrix_hash[2];
+        restart_hash128(matrix, amount, matrix_hash);
+        restart_result_key(matrix_hash, hi, engine, full, results_dir, result_key, sizeof(result_key), result_path, sizeof(result_path));
+        if (restart_result_read(result_path, result_key, hi, &result) == 0) {
+            if (verbose) cerr << "Result from " << result_path << endl;
+            print_restart_result(&result);
+            exit(0);
+        }
     }
 
-    if      (bigor < 2)   bps = 1;
-    else if (bigor < 4)   bps = 2;
-    else if (bigor < 8)   bps = 3;
-    else if (bigor < 16)  bps = 4;
-    else if (bigor < 32)  bps = 5;
-    else if (bigor < 64)  bps = 6;
-    else if (bigor < 128) bps = 7;
-    else                  bps = 8;
-
-    // Read data into matrix
-
-    int row;
-    int column;
-    int index = 0;
-    for (row=0; row<1000; row++) {
-        for (column=0; column<1000; column++) {
-            matrix[row][column] = buffer[index++];
+    if (matrix != NULL) {
+        if (verbose) cerr << "Counting with " << jobs << " worker thread" << ((jobs == 1) ? "" : "s") << endl;
+        if (restart_count_matrix(&counts, matrix, jobs) != 0) {
+            cerr << "ERROR: Failed to allocate the symbol counts" << endl;
+            exit(-1);
         }
+        free(matrix);
     }
 
-    // Restart Test
-    //
-    //
-    const int digits = 2000;
-    mpreal::set_default_prec(mpfr::digits2bits(digits));
-
-    mpreal bigp;
-    mpreal bigp_increment;
-    mpreal small_p;
-    mpreal alpha = 0.000005;
-    mpreal first;
-    mpreal second;
-    mpreal third;
-
-    int row_max = 0;
-    int row_max_max = 0;
-    int row_total=0;
-    int column_max = 0;
-    int column_max_max = 0;
-    int column_total=0;
-    int xmax = 0;
-
-    int frequency[256];
-    
-    if (verbose) cerr << "Counting row and columns symbols maximums." << endl;
+    if (ifp != stdin) fclose(ifp);
 
-    int max_f;
-    
-    for (row=0;row<1000;row++) {
-        row_total = 0;
-        row_max = 0;
-        
-        for (i=0;i<256;i++) frequency[i] = 0;
-        
-        for (column = 0;column < 1000; column++) {
-            abyte = matrix[row][column];
-            frequency[(int)abyte]++;
-            if  (frequency[(int)abyte] > row_max) row_max = frequency[(int)abyte];
-        }   
-        if (row_max > row_max_max) row_max_max = row_max;
-        
+    // A batch of H_I only needs Xmax from the counts.
+    if (nhis > 0) {
+        restart_maxima(&counts, &result);
+        restart_counts_free(&counts);
+        if (verbose) cerr << "Xmax = " << result.xmax << endl;
+        print_hi_batch(cachep, 1000, result.xmax, his, nhis, engine, jobs);
+        free(his);
+        exit(0);
     }
 
-    for (column=0;column<1000;column++) {
-        column_total = 0;
-        column_max = 0;
-        
-        for (i=0;i<256;i++) frequency[i] = 0;
-        
-        for (row = 0;row < 1000; row++) {
-            abyte = matrix[row][column];
-            frequency[(int)abyte]++;
-            if  (frequency[(int)abyte] > column_max) column_max = frequency[(int)abyte];
-        }   
-        if (column_max > column_max_max) column_max_max = column_max;
-    }
-    
-    if (column_max_max > row_max_max) xmax = column_max_max;
-    else xmax = row_max_max;
-
-    if (verbose) cout << "Computing P(X <= Xmax)." << endl;
-
-    small_p = pow((mpreal)2.0,(mpreal)-hi);
-    alpha = (mpreal)0.000005;
-
-    bigp = 0.0;
-
-    for (j=xmax;j<=1000;j++) {
-
-        first  = (mpreal)(choose((mpreal)1000,(mpreal)j));
-        second = pow(small_p,(mpreal)(j));
-        third  = pow(((mpreal)1.0)-small_p,(mpreal)(1000-j)); 
-
-        bigp_increment = first*second*third;
-        bigp+=bigp_increment;
-
-        if (verbose) {
-            cerr <<  "j="        << setw(5)   << j;
-            cerr <<  "  bigp="  << setw(12)   << bigp;
-            cerr <<  "  bigp_increment=" << setw(12)  << bigp_increment;
-            cerr << "  choose(1000," << setw(4) << j << ")=" << setw(12)   << first;
-            cerr << "  pow("<<small_p<<","  << setw(4) << j << ") = "<< setw(12)  << second;
-            cerr << "\tpow(1-p,(1000-j))="  << setw(12)       << third;
-            cerr << endl;
-        }
+    // Restart Test
+    restart_finish(&counts, hi, engine, cachep, verbose, &result);
+    restart_counts_free(&counts);
+    print_restart_result(&result);
+    if ((results_dir != NULL) && (restart_result_write(result_path, result_key, &result) != 0)) {
+        cerr << "WARNING: Failed to save the result to " << result_path << endl;
     }
-
-    //fprintf(stderr,"\n choose(6,4) = %f\n",choose(6,4));
-    cerr << endl;
-    cerr << "    ---- Results -----" << endl;
-    cerr << setw(18) << "Bits per symbol = "<< setw(8) << bps << endl; 
-    cerr << setw(18) << "H_I = "            << setw(8) << hi << endl; 
-    cerr << setw(18) << "alpha = "          << setw(8) << "0.000005" << endl; 
-    cerr << setw(18) << "p = "              << setw(8) <<  small_p << endl;
-    cerr << setw(18) << "row_max_max = "    << setw(8) << row_max_max << endl;
-    cerr << setw(18) << "column_max_max = " << setw(8) << column_max_max << endl;
-    cerr << setw(18) << "Xmax = "           << setw(8) << xmax << endl;
-    cerr << setw(18) << "P(x => xmax) = "   << setw(8) << bigp << endl;
-
-    if (bigp < alpha) cerr << setw(18) << "Result = " << setw(8) << "FAIL" << endl;
-    else cerr << setw(18) << "Result = " << setw(8) << "PASS" << endl;
+    if (inverse) print_max_hi(restart_max_hi(1000, result.xmax, engine, jobs, verbose));
+    if (audit) restart_tail_audit(1000, result.xmax, hi);
+    if (cachep != NULL) restart_cache_close(cachep);
 }
 
-
@@ -35,6 +35,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -44,14 +47,36 @@
 #include <math.h>
 #include <iostream>
 #include <iomanip>
+#include <atomic>
+#include <thread>
+#include "restart_check.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
 
 void display_usage() {
 fprintf(stderr,"Usage: restart_slicer [-l <bits_per_symbol 1-8>][-B|-L][-v][-h][-o <out filename>] [filename_glob_pattern]\n");
 fprintf(stderr,"       -l , --length <bits_per_symbol 1-8> Set the number of bits to encode in eat output byte\n");
-fprintf(stderr,"       -s , --skip <bits_per_symbol 1-8> Number of bytes to skip in each binary file\n");
+fprintf(stderr,"       -s , --skip <n>                     Number of bytes to skip in each binary file\n");
+fprintf(stderr,"       -S , --skip-table <filename>        Read a separate skip for each binary file, 1000 numbers in file order\n");
+fprintf(stderr,"       -C , --stride <n>                   Read the 1000 restarts as records every n bytes of one capture file\n");
+fprintf(stderr,"       -H , --header <n>                   Number of header bytes at the start of each record (with -C)\n");
+fprintf(stderr,"       -F , --framed                       Read 1000 length-prefixed records from stdin, a FIFO or a file (- is stdin)\n");
+fprintf(stderr,"       -c , --check                        Run the restart sanity check on the matrix (writes the matrix only with -o)\n");
+fprintf(stderr,"       -e , --H_I <H_I>                    Initial Entropy Estimate for --check\n");
+fprintf(stderr,"       -f , --full                         With --check, count the whole matrix and compute P(X >= Xmax) even once it is known to fail\n");
+fprintf(stderr,"       -j , --jobs <n>                     Read and unpack the input files, and count for --check, with n worker threads (0 = all cores) (default 1)\n");
+fprintf(stderr,"       -U , --uring                        Read the input files in batches with Linux io_uring (falls back to pread, not with -j)\n");
+fprintf(stderr,"       -M , --mmap                         Map each input file read-only and unpack straight from the mapping\n");
 fprintf(stderr,"       -r , --reverse                      Interpret input binary data as big endian (MSB first) (default is little endian)\n");
-fprintf(stderr,"       -B , --bigendian                    Unpack output multi-bit symbols as big-endian (msb first)\n");
-fprintf(stderr,"       -L , --littleendian                 Unpack output multi-bit symbols as little-endian (lsb first) (default)\n");
+fprintf(stderr,"       -B , --bigendian                    Unpack output multi-bit symbols as big-endian (msb first) (default)\n");
+fprintf(stderr,"       -L , --littleendian                 Unpack output multi-bit symbols as little-endian (lsb first)\n");
 fprintf(stderr,"       -v , --verbose                      Output information to stderr\n");
 fprintf(stderr,"       -h , --help                         Output this information\n");
 fprintf(stderr,"\n");
@@ -73,6 +98,771 @@ void printsample(unsigned char *thesample)
     }
 }
 
+/********
+* Options that control how each input file is turned into a row of 1000 symbols.
+*/
+struct slice_options {
+    int bps;
+    off_t skip_bytes;
+    const off_t *skip_table;
+    off_t stride;                       // single-file mode record stride, 0 for 1000 files
+    off_t header;                       // single-file mode per-record header
+    int capture_fd;                     // single-file mode open capture, or -1
+    const unsigned char *capture_map;   // single-file mode mmap of the capture, or NULL
+    off_t capture_size;
+    int reverse;
+    int littleendian;
+    int use_mmap;
+    int verbose;
+};
+
+/********
+* Symbol unpacking kernel.
+*
+* The input bytes are a bit stream, taken lsb first from each byte, or msb
+* first with -r. Each symbol is the next bps bits of the stream. With the
+* default -B order the first bit of a symbol is its msb, with -L it is the lsb.
+*
+* 8 symbols of bps bits are exactly bps bytes, so the kernel works on groups
+* of bps bytes. A group is loaded into a 64 bit word with stream bit k at bit
+* k, and each 8 bit lane of the output word receives one symbol. On CPUs with
+* a fast BMI2 PDEP that spread is a single instruction, otherwise it is done
+* with shifts and masks. No per-bit branches and no one-bit-per-byte FIFO.
+*/
+
+// Reverse the order of the bits within each byte of x.
+static inline uint64_t bitrev_bytes(uint64_t x)
+{
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    return x;
+}
+
+static inline uint64_t load_le64(const unsigned char *p, int nbytes)
+{
+    uint64_t x = 0;
+    memcpy(&x, p, nbytes);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static inline void store_le64(unsigned char *p, uint64_t x)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+// Load group g of BPS bytes as stream bits. Reads 8 bytes when that stays
+// inside the input so the common case is a single unaligned load.
+template <int BPS>
+static inline uint64_t load_group(const unsigned char *in, size_t inlen, int g, int reverse)
+{
+    const unsigned char *p = in+((size_t)g*BPS);
+    uint64_t x;
+
+    if (((size_t)g*BPS)+8 <= inlen) {
+        x = load_le64(p, 8);
+        if (BPS < 8) x &= (1ULL << ((8*BPS) & 63))-1;
+    } else {
+        x = load_le64(p, BPS);
+    }
+    if (reverse) x = bitrev_bytes(x);
+    return x;
+}
+
+// Turn each lane from lsb-first into msb-first symbol order.
+template <int BPS>
+static inline uint64_t msb_first_lanes(uint64_t x)
+{
+    return (bitrev_bytes(x) >> (8-BPS)) & (((1ULL << BPS)-1)*0x0101010101010101ULL);
+}
+
+template <int BPS>
+void unpack_symbols_scalar(const unsigned char *in, size_t inlen, unsigned char *out, int nsymbols, int reverse, int littleendian)
+{
+    const uint64_t symmask = (1ULL << BPS)-1;
+    uint64_t x;
+    uint64_t y;
+    int g;
+    int s;
+
+    for (g=0;g<(nsymbols/8);g++) {
+        x = load_group<BPS>(in, inlen, g, reverse);
+        y = 0;
+        for (s=0;s<8;s++) y |= ((x >> (s*BPS)) & symmask) << (8*s);
+        if (littleendian==0) y = msb_first_lanes<BPS>(y);
+        store_le64(out+(8*g), y);
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_PDEP_KERNEL 1
+
+template <int BPS>
+__attribute__((target("bmi2")))
+void unpack_symbols_pdep(const unsigned char *in, size_t inlen, unsigned char *out, int nsymbols, int reverse, int littleendian)
+{
+    const uint64_t lanemask = ((1ULL << BPS)-1)*0x0101010101010101ULL;
+    uint64_t y;
+    int g;
+
+    for (g=0;g<(nsymbols/8);g++) {
+        y = _pdep_u64(load_group<BPS>(in, inlen, g, reverse), lanemask);
+        if (littleendian==0) y = msb_first_lanes<BPS>(y);
+        store_le64(out+(8*g), y);
+    }
+}
+#endif
+
+typedef void (*unpack_fn)(const unsigned char *, size_t, unsigned char *, int, int, int);
+
+#define UNPACK_KERNELS(name) { name<1>, name<2>, name<3>, name<4>, name<5>, name<6>, name<7>, name<8> }
+
+static const unpack_fn unpack_scalar_kernels[8] = UNPACK_KERNELS(unpack_symbols_scalar);
+#ifdef HAVE_PDEP_KERNEL
+static const unpack_fn unpack_pdep_kernels[8] = UNPACK_KERNELS(unpack_symbols_pdep);
+#endif
+
+// PDEP is microcoded and very slow on AMD before Zen 3, so only use it
+// where it is a single cycle instruction.
+const unpack_fn *select_unpack_kernels()
+{
+#ifdef HAVE_PDEP_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2"))
+        return unpack_pdep_kernels;
+#endif
+    return unpack_scalar_kernels;
+}
+
+/********
+* unpack_symbols() unpacks nsymbols (a multiple of 8) symbols of bps bits from
+* the packed bytes at in into out, one symbol per byte. inlen must be at
+* least nsymbols*bps/8.
+*/
+void unpack_symbols(const unsigned char *in, size_t inlen, unsigned char *out, int nsymbols, int bps, int reverse, int littleendian)
+{
+    static const unpack_fn *kernels = select_unpack_kernels();
+
+    kernels[bps-1](in, inlen, out, nsymbols, reverse, littleendian);
+}
+
+/********
+* file_skip() is the number of bytes to skip at the start of file filenumber.
+*/
+off_t file_skip(const slice_options *so, int filenumber)
+{
+    if (so->skip_table != NULL) return so->skip_table[filenumber];
+    return so->skip_bytes;
+}
+
+/********
+* row_offset() is where the data for row filenumber starts in its file. In
+* single-file mode rows are records at a fixed stride, each with a header.
+*/
+off_t row_offset(const slice_options *so, int filenumber)
+{
+    if (so->stride > 0) return ((off_t)filenumber*so->stride)+so->header+file_skip(so, filenumber);
+    return file_skip(so, filenumber);
+}
+
+/********
+* payload_bytes() is how much data is read for each row. Whole files have
+* always been required to hold one byte more than the 1000 symbols; records
+* in a single-file capture only need the symbols themselves.
+*/
+size_t payload_bytes(const slice_options *so)
+{
+    if (so->stride > 0) return (size_t)((1000*so->bps)/8);
+    return (size_t)(1+((1000*so->bps)/8));
+}
+
+/********
+* read_skip_table() reads the 1000 per-file skips for -S. The numbers are
+* separated by white space and may be decimal, 0x hex or 0 octal.
+* Returns 0 on success, -1 on error.
+*/
+int read_skip_table(const char *tablename, off_t *table)
+{
+    FILE *tfp;
+    char word[64];
+    char *end;
+    long long value;
+    int count = 0;
+
+    tfp = fopen(tablename, "r");
+    if (tfp == NULL) {
+        fprintf(stderr,"ERROR: Failed to open skip table %s for reading\n",tablename);
+        return -1;
+    }
+    while (fscanf(tfp, "%63s", word) == 1) {
+        value = strtoll(word, &end, 0);
+        if ((*end != (char)0) || (value < 0)) {
+            fprintf(stderr,"ERROR: Bad skip value '%s' in skip table %s\n",word,tablename);
+            fclose(tfp);
+            return -1;
+        }
+        if (count == 1000) {
+            fprintf(stderr,"ERROR: Skip table %s has more than 1000 entries\n",tablename);
+            fclose(tfp);
+            return -1;
+        }
+        table[count++] = (off_t)value;
+    }
+    fclose(tfp);
+    if (count != 1000) {
+        fprintf(stderr,"ERROR: Skip table %s has %d entries, need 1000\n",tablename,count);
+        return -1;
+    }
+    return 0;
+}
+
+/********
+* unpack_row() turns the len bytes of capture data that follow the skipped
+* bytes into row[0..999], one symbol per byte. Returns 0 on success, -1 on error.
+*/
+int unpack_row(const unsigned char *data, size_t len, unsigned char *row, const slice_options *so, const char *infilename)
+{
+    size_t i;
+    size_t symbol_count;
+
+    if (so->verbose) {
+        for (i=0;i<len;i++) fprintf(stderr,"%02x",data[i]);
+        fprintf(stderr,"\n");
+    }
+
+    // Work out how many full symbols are in the data.
+    symbol_count = (len*8) / so->bps;
+    if (so->verbose) fprintf(stderr,"Found %d symbols in buffer\n",(int)symbol_count);
+    if (symbol_count < 1000) {
+        fprintf(stderr,"Not enough symbols in file %s, need 1000, got %d\n",infilename,(int)symbol_count);
+        return -1;
+    }
+
+    unpack_symbols(data, len, row, 1000, so->bps, so->reverse, so->littleendian);
+    return 0;
+}
+
+/********
+* slice_file_pread() reads the payload of one binary restart file, or one record
+* of a single-file capture, with pread() at row_offset(), so the skipped bytes
+* are never read and the cost does not depend on the size of the skip. Unpacks
+* the first 1000 symbols into row[0..999]. Returns 0 on success, -1 on error.
+*/
+int slice_file_pread(const char *infilename, int filenumber, unsigned char *row, const slice_options *so)
+{
+    using std::cerr;
+    using std::endl;
+
+    unsigned char buffer[1008];
+
+    int fd;
+    ssize_t got;
+    size_t len;
+    size_t amount;
+
+    off_t skip = row_offset(so, filenumber);
+    int verbose = so->verbose;
+
+    if (verbose) fprintf(stderr,"File# %d, Filename %s\t",filenumber,infilename);
+
+    fd = so->capture_fd;
+    if (fd < 0) fd = open(infilename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr,"failed to open input file for reading");
+        return -1;
+    }
+
+    // 1000 samples is all the data we need
+    amount = payload_bytes(so);
+    len = 0;
+    while (len < amount) {
+        got = pread(fd, buffer+len, amount-len, skip+(off_t)len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        len += (size_t)got;
+    }
+    if (so->capture_fd < 0) close(fd);
+    if (verbose) cerr <<"read " << len << "/" << amount << " skip_bytes=" << skip << endl;
+    
+    if (len != amount) {
+        cerr << "Error only " << len << " bytes read after skipping " << skip << " bytes" << endl;
+        return -1;
+    }
+
+    return unpack_row(buffer, len, row, so, infilename);
+}
+
+/********
+* slice_file_mmap() maps the part of one binary restart file that is needed
+* read-only and unpacks straight from the mapping, so there is no copy and no
+* limit on the skip. Returns 0 on success, -1 on error.
+*/
+int slice_file_mmap(const char *infilename, int filenumber, unsigned char *row, const slice_options *so)
+{
+    using std::cerr;
+    using std::endl;
+
+    struct stat st;
+    int fd;
+    unsigned char *map;
+    off_t map_start;
+    size_t map_len;
+    size_t amount;
+    size_t len;
+    int rc;
+
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t skip = row_offset(so, filenumber);
+    int verbose = so->verbose;
+
+    if (verbose) fprintf(stderr,"File# %d, Filename %s\t",filenumber,infilename);
+
+    // 1000 samples is all the data we need
+    amount = payload_bytes(so);
+
+    // A single-file capture is mapped once up front.
+    if (so->capture_map != NULL) {
+        len = 0;
+        if (so->capture_size > skip) len = (size_t)(so->capture_size-skip);
+        if (len > amount) len = amount;
+        if (verbose) cerr <<"read " << len << "/" << amount << " skip_bytes=" << skip << endl;
+        if (len != amount) {
+            cerr << "Error only " << len << " bytes read after skipping " << skip << " bytes" << endl;
+            return -1;
+        }
+        return unpack_row(so->capture_map+skip, amount, row, so, infilename);
+    }
+
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr,"failed to open input file for reading");
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("failed to stat input file");
+        close(fd);
+        return -1;
+    }
+
+    len = 0;
+    if (st.st_size > skip) len = (size_t)(st.st_size-skip);
+    if (len > amount) len = amount;
+    if (verbose) cerr <<"read " << len << "/" << amount << " skip_bytes=" << skip << endl;
+
+    if (len != amount) {
+        cerr << "Error only " << len << " bytes read after skipping " << skip << " bytes" << endl;
+        close(fd);
+        return -1;
+    }
+
+    // mmap offsets must be page aligned, so map from the page holding the first byte.
+    map_start = (skip / pagesize) * pagesize;
+    map_len = (size_t)(skip-map_start)+amount;
+    map = (unsigned char *)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("failed to mmap input file");
+        return -1;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    madvise(map, map_len, MADV_WILLNEED);
+
+    rc = unpack_row(map+(skip-map_start), amount, row, so, infilename);
+    munmap(map, map_len);
+    return rc;
+}
+
+/********
+* slice_file() reads one binary restart file with the selected per-file
+* backend. Returns 0 on success, -1 on error.
+*/
+int slice_file(const char *infilename, int filenumber, unsigned char *row, const slice_options *so)
+{
+    if (so->use_mmap) return slice_file_mmap(infilename, filenumber, row, so);
+    return slice_file_pread(infilename, filenumber, row, so);
+}
+
+/********
+* read_full() reads n bytes from fd, retrying short reads as pipes deliver
+* them. Returns the number of bytes read, which is less than n only at end
+* of file, or -1 on error.
+*/
+ssize_t read_full(int fd, unsigned char *buf, size_t n)
+{
+    size_t len = 0;
+    ssize_t got;
+
+    while (len < n) {
+        got = read(fd, buf+len, n-len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) break;
+        len += (size_t)got;
+    }
+    return (ssize_t)len;
+}
+
+// Read and throw away n bytes. Returns 0, or -1 on a short read.
+int discard_bytes(int fd, uint64_t n)
+{
+    unsigned char scratch[65536];
+    size_t chunk;
+
+    while (n > 0) {
+        chunk = (n > sizeof(scratch)) ? sizeof(scratch) : (size_t)n;
+        if (read_full(fd, scratch, chunk) != (ssize_t)chunk) return -1;
+        n -= chunk;
+    }
+    return 0;
+}
+
+/********
+* slice_stream() reads 1000 framed restart records from a pipe, FIFO or file
+* and writes each row as soon as its record is complete. A frame is a 4 byte
+* little-endian record length followed by the record. The record header and
+* skip are read past, the 1000*bps/8 data bytes are unpacked, and the rest of
+* the record is discarded, so only one record's data is held in memory.
+* Rows are written to ofp if it is not NULL and kept in matrix if it is not
+* NULL. Returns 0 on success, -1 on error.
+*/
+int slice_stream(int fd, const char *infilename, FILE *ofp, unsigned char *matrix, const slice_options *so)
+{
+    unsigned char prefix[4];
+    unsigned char buffer[1008];
+    unsigned char row[1000];
+    uint64_t reclen;
+    uint64_t offset;
+    size_t amount = (size_t)((1000*so->bps)/8);
+    ssize_t got;
+    int record;
+
+    for (record=0;record<1000;record++) {
+        got = read_full(fd, prefix, 4);
+        if (got != 4) {
+            fprintf(stderr,"ERROR: %s ended after %d records, need 1000\n",infilename,record);
+            return -1;
+        }
+        reclen = (uint64_t)prefix[0] | ((uint64_t)prefix[1] << 8) | ((uint64_t)prefix[2] << 16) | ((uint64_t)prefix[3] << 24);
+        offset = (uint64_t)(so->header+file_skip(so, record));
+        if (so->verbose) fprintf(stderr,"Record# %d, length %llu, skip_bytes=%llu\n",record,(unsigned long long)reclen,(unsigned long long)offset);
+
+        if (offset+amount > reclen) {
+            fprintf(stderr,"ERROR: record %d is %llu bytes, too short for %llu header/skip bytes and %d data bytes\n",record,(unsigned long long)reclen,(unsigned long long)offset,(int)amount);
+            return -1;
+        }
+        if ((discard_bytes(fd, offset) != 0) || (read_full(fd, buffer, amount) != (ssize_t)amount) || (discard_bytes(fd, reclen-offset-amount) != 0)) {
+            fprintf(stderr,"ERROR: %s ended in the middle of record %d\n",infilename,record);
+            return -1;
+        }
+
+        if (unpack_row(buffer, amount, row, so, infilename) != 0) return -1;
+        if (matrix != NULL) memcpy(matrix+(1000*record), row, 1000);
+        if (ofp != NULL) {
+            fwrite(row, 1000, 1, ofp);
+            fflush(ofp);
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/********
+* A minimal io_uring driver, talking to the kernel through the raw syscalls so
+* there is no dependency on liburing. The restart files are opened, read and
+* closed in batches of URING_BATCH, each batch costing three io_uring_enter()
+* calls instead of three syscalls per file. The reads land in one buffer pool
+* that is registered with the kernel, so the kernel does not have to map the
+* user pages for every read.
+*/
+#define URING_BATCH 256
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+void uring_exit(uring *ring)
+{
+    if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if ((ring->cq_ring != MAP_FAILED) && (ring->cq_ring != ring->sq_ring)) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Returns 0 on success, -1 if io_uring is not usable on this system.
+int uring_init(uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    size_t probe_size;
+    int ok;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_ring = MAP_FAILED;
+    ring->cq_ring = MAP_FAILED;
+    ring->sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+    // Check the kernel knows the opcodes we need (openat needs 5.6).
+    probe_size = sizeof(struct io_uring_probe) + (256*sizeof(struct io_uring_probe_op));
+    probe = (struct io_uring_probe *)calloc(1, probe_size);
+    ok = 0;
+    if ((probe != NULL) && (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) >= 0)) {
+        ok = (probe->last_op >= IORING_OP_CLOSE) &&
+             (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!ok) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + (params.sq_entries*sizeof(unsigned));
+    ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries*sizeof(struct io_uring_cqe));
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            uring_exit(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// Grab the next free submission entry, zeroed. The caller never queues more
+// than the ring size between submissions.
+struct io_uring_sqe *uring_get_sqe(uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Submit count queued entries and wait for all count completions, storing
+// each result at results[user_data]. Returns 0, or -1 if io_uring_enter fails.
+int uring_submit_and_wait(uring *ring, unsigned count, int *results)
+{
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    unsigned head;
+    struct io_uring_cqe *cqe;
+    long ret;
+
+    while (completed < count) {
+        ret = syscall(__NR_io_uring_enter, ring->fd, count-submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        submitted += (unsigned)ret;
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/********
+* uring_read_files() reads amount bytes from offset row_offset() of each of the
+* 1000 files into pool+(filenumber*amount). In single-file mode every read
+* uses the one open capture and there is nothing to open or close.
+* Returns 0 on success, -1 on a read error and 1 if io_uring is not available,
+* in which case the caller falls back to pread.
+*/
+int uring_read_files(char **filenames, unsigned char *pool, size_t amount, const slice_options *so)
+{
+    using std::cerr;
+    using std::endl;
+
+    uring ring;
+    struct iovec iov;
+    struct io_uring_sqe *sqe;
+    int fds[URING_BATCH];
+    int results[URING_BATCH];
+    int fixed;
+    int first;
+    int count;
+    int i;
+    int error = 0;
+    int stale = 0;
+
+    if (uring_init(&ring, URING_BATCH) != 0) return 1;
+
+    // Register the pool so reads can use READ_FIXED. If the memlock limit
+    // does not allow it, plain READ into the same pool still works.
+    iov.iov_base = pool;
+    iov.iov_len = amount*1000;
+    fixed = (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+    if (so->verbose) fprintf(stderr,"io_uring buffer pool %s\n", fixed ? "registered" : "not registered, using plain reads");
+
+    for (first=0;(first<1000) && (error==0);first+=URING_BATCH) {
+        count = 1000-first;
+        if (count > URING_BATCH) count = URING_BATCH;
+
+        if (so->capture_fd >= 0) {
+            for (i=0;i<count;i++) fds[i] = so->capture_fd;
+        } else {
+            for (i=0;i<count;i++) {
+                sqe = uring_get_sqe(&ring);
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = (uint64_t)(uintptr_t)filenames[first+i];
+                sqe->open_flags = O_RDONLY;
+                sqe->user_data = i;
+            }
+            if (uring_submit_and_wait(&ring, count, fds) != 0) {
+                perror("io_uring_enter failed");
+                uring_exit(&ring);
+                return -1;
+            }
+        }
+
+        for (i=0;i<count;i++) {
+            if (fds[i] < 0) {
+                fprintf(stderr,"failed to open input file %s for reading\n",filenames[first+i]);
+                error = 1;
+            }
+        }
+
+        // Only queue the reads once every open has worked, so no reads are
+        // left queued ahead of the closes below.
+        for (i=0;(i<count) && (error==0);i++) {
+            sqe = uring_get_sqe(&ring);
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = fds[i];
+            sqe->addr = (uint64_t)(uintptr_t)(pool+((first+i)*amount));
+            sqe->len = (unsigned)amount;
+            sqe->off = (uint64_t)row_offset(so, first+i);
+            sqe->buf_index = 0;
+            sqe->user_data = i;
+            results[i] = 0;
+        }
+        if ((error == 0) && (uring_submit_and_wait(&ring, count, results) != 0)) {
+            perror("io_uring_enter failed");
+            error = 1;
+            stale = 1;
+        }
+
+        for (i=0;(i<count) && (error==0);i++) {
+            if (so->verbose) fprintf(stderr,"File# %d, Filename %s\tread %d/%d skip_bytes=%lld\n",first+i,filenames[first+i],results[i],(int)amount,(long long)row_offset(so, first+i));
+            if (results[i] != (int)amount) {
+                cerr << "Error only " << ((results[i] < 0) ? 0 : results[i]) << " bytes read from " << filenames[first+i] << " after skipping " << row_offset(so, first+i) << " bytes" << endl;
+                error = 1;
+            }
+        }
+
+        // Close whatever was opened, even after an error. If the reads could
+        // not be submitted they may still be queued, so close directly.
+        int nclose = 0;
+        for (i=0;(i<count) && (so->capture_fd<0);i++) {
+            if (fds[i] < 0) continue;
+            if (stale) {
+                close(fds[i]);
+                continue;
+            }
+            sqe = uring_get_sqe(&ring);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i];
+            sqe->user_data = i;
+            nclose++;
+        }
+        if (nclose > 0) uring_submit_and_wait(&ring, nclose, results);
+    }
+
+    uring_exit(&ring);
+    return error ? -1 : 0;
+}
+#endif
+
+/********
+* Worker pool for -j. Each worker claims the next unread file number, so the
+* slow open/read latency of many files overlaps. Rows land in their own slot
+* of the matrix so the output order does not depend on completion order.
+*/
+struct slice_job {
+    char **filenames;
+    unsigned char *matrix;
+    const slice_options *so;
+    std::atomic<int> next;
+    std::atomic<int> failed;
+};
+
+void slice_worker(slice_job *job)
+{
+    int filenumber;
+
+    while (job->failed == 0) {
+        filenumber = job->next++;
+        if (filenumber >= 1000) break;
+        if (slice_file(job->filenames[filenumber], filenumber, job->matrix+(1000*filenumber), job->so) != 0) {
+            job->failed = 1;
+        }
+    }
+}
+
 /********
 * main() is mostly about parsing and qualifying the command line options.
 */
@@ -84,42 +874,22 @@ int main(int argc, char** argv)
     using std::endl;
     using std::setw;
 
-    unsigned char buffer[2048];
-
-    #define BITBUFFER_SIZE 8192
-    unsigned char bitbuffer[BITBUFFER_SIZE];
-    int bitbuffer_index = 0;
-
     unsigned char outbuffer[1000001];
-    int outindex = 0;
-    int bytecount = 0;
-    int done=0;
-    size_t len;
-    unsigned char abit;
-
-    int symbol_count;
-    int j;
-    int runcount = 0;
-    int last_abyte = -1;
-    int max_runcount = 0;
-    int location = 0;
+    unsigned char *matrix = NULL;
 
     int opt;
-    int i;
     int filenumber;
 
-    FILE *ifp;
     FILE *ofp;
     int using_outfile = 0;  /* use stdout instead of outputfile*/
-    int using_infile;
+    int using_infile = 0;
     char filename[8192];
     char infilemask[8192];
     char infilename[8192];
     
     int bps = 1;   
-    int abyte;
     
-    int littleendian=1;
+    int littleendian=0;
     int gotL=0;
     int gotB=0;
     int verbose = 0;
@@ -133,15 +903,29 @@ int main(int argc, char** argv)
     /* get the options and arguments */
     int longIndex;
 
-    int skip_bytes = 0;
+    off_t skip_bytes = 0;
+    off_t *skip_table = NULL;
+    off_t stride = 0;
+    off_t header = 0;
+    char *rownames[1000];
+    int framed = 0;
+    int check = 0;
+    int full = 0;
+    double hi = 0.8;
+    FILE *mfp = NULL;
+    char *end;
     int filenamecount =0;
 
-    int amount;
+    int jobs = 1;
+    int t;
+    int use_uring = 0;
+    int use_mmap = 0;
+    const char *backend;
 
     //printf("choose(1000,849) = %f\n",choose(1000,849));
     //exit(1);
 
-    char optString[] = "o:k:l:w:s:BLrvh";
+    char optString[] = "o:k:l:w:s:S:C:H:Fcfe:j:UMBLrvh";
     static const struct option longOpts[] = {
     { "output", no_argument, NULL, 'o' },
     { "reverse", no_argument, NULL, 'r' },
@@ -149,6 +933,16 @@ int main(int argc, char** argv)
     { "littleendian", no_argument, NULL, 'L' },
     { "bits_per_symbol", required_argument, NULL, 'l' },
     { "skip", required_argument, NULL, 's' },
+    { "skip-table", required_argument, NULL, 'S' },
+    { "stride", required_argument, NULL, 'C' },
+    { "header", required_argument, NULL, 'H' },
+    { "framed", no_argument, NULL, 'F' },
+    { "check", no_argument, NULL, 'c' },
+    { "full", no_argument, NULL, 'f' },
+    { "H_I", required_argument, NULL, 'e' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "uring", no_argument, NULL, 'U' },
+    { "mmap", no_argument, NULL, 'M' },
     { "verbose", no_argument, NULL, 'v' },
     { "help", no_argument, NULL, 'h' },
     { NULL, no_argument, NULL, 0 }
@@ -170,13 +964,63 @@ int main(int argc, char** argv)
                 };
                 break;
             case 's':
-                skip_bytes = atoi(optarg);
-                if (skip_bytes < 0) {
-                    perror("Error, skip_bytes must be positive");
+                skip_bytes = (off_t)strtoll(optarg, &end, 0);
+                if ((*end != (char)0) || (skip_bytes < 0)) {
+                    fprintf(stderr,"Error, skip_bytes must be a positive number\n");
+                    display_usage();
+                    exit(-1);
+                }
+                break;
+            case 'C':
+                stride = (off_t)strtoll(optarg, &end, 0);
+                if ((*end != (char)0) || (stride < 1)) {
+                    fprintf(stderr,"Error, the record stride must be a positive number\n");
+                    display_usage();
+                    exit(-1);
+                }
+                break;
+            case 'H':
+                header = (off_t)strtoll(optarg, &end, 0);
+                if ((*end != (char)0) || (header < 0)) {
+                    fprintf(stderr,"Error, the record header length must be a positive number\n");
                     display_usage();
                     exit(-1);
                 }
                 break;
+            case 'F':
+                framed=1;
+                break;
+            case 'c':
+                check=1;
+                break;
+            case 'f':
+                full=1;
+                break;
+            case 'e':
+                hi = atof(optarg);
+                if (!((hi >= 0.0) && (hi <= RESTART_MAX_HI))) {
+                    fprintf(stderr,"Error, H_I must be between 0 and %g, got %g\n", RESTART_MAX_HI, hi);
+                    exit(-1);
+                }
+                break;
+            case 'S':
+                skip_table = (off_t *)malloc(1000*sizeof(off_t));
+                if ((skip_table == NULL) || (read_skip_table(optarg, skip_table) != 0)) exit(-1);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 0) {
+                    perror("Error, jobs must be positive");
+                    display_usage();
+                    exit(-1);
+                }
+                break;
+            case 'U':
+                use_uring=1;
+                break;
+            case 'M':
+                use_mmap=1;
+                break;
             case 'r':
                 reverse=1;
                 break;
@@ -205,11 +1049,26 @@ int main(int argc, char** argv)
         opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
     } // end while
     
+    if (use_uring==1 && use_mmap==1) {
+        fprintf(stderr,"ERROR, Can't use io_uring (-U) and mmap (-M) input at the same time\n");
+        exit(-1);
+    }
+
+    if ((framed==1) && (use_uring==1 || use_mmap==1 || stride > 0)) {
+        fprintf(stderr,"ERROR, framed input (-F) is read as a stream and can't be combined with -U, -M or -C\n");
+        exit(-1);
+    }
+
     if (gotB==1 && gotL==1) {
         fprintf(stderr,"ERROR, Can't be both big endian (-B) and little endian (-L) at the same time\n");
         exit(-1);
     }
 
+    if (use_uring && (jobs != 1)) {
+        fprintf(stderr,"ERROR, io_uring reads (-U) run on one thread and can't be combined with -j\n");
+        exit(-1);
+    }
+
     if (optind < argc) {
         strcpy(infilemask,argv[optind]);
         using_infile = 1;
@@ -218,10 +1077,10 @@ int main(int argc, char** argv)
     if (verbose==1) {
         fprintf(stderr,"Verbose mode enabled\n");
         if (reverse==1) fprintf(stderr, "Input data interpreted as big-endian (msb first)\n");
-        if (littleendian==0) fprintf(stderr, "Output multi-bit symbols encoded as big endian (MSB first)\n");
-        if (littleendian==1) fprintf(stderr, "Output multi-bit symbols encoded as little endian (LSB first) (default)\n");
-        if (((gotB==1) || (gotL==1)) && (bps > 1)){
-            printf("Warning: -L and -B arguments have so effect with 1 bit output symbols\n"); 
+        if (littleendian==0) fprintf(stderr, "Output multi-bit symbols encoded as big endian (MSB first) (default)\n");
+        if (littleendian==1) fprintf(stderr, "Output multi-bit symbols encoded as little endian (LSB first)\n");
+        if (((gotB==1) || (gotL==1)) && (bps == 1)){
+            fprintf(stderr,"Warning: -L and -B arguments have no effect with 1 bit output symbols\n"); 
         }
         if (using_infile==1) {
             fprintf(stderr,"Reading binary data from file: %s\n", infilename);
@@ -243,6 +1102,65 @@ int main(int argc, char** argv)
         }
     }
 
+    slice_options so;
+    so.bps = bps;
+    so.skip_bytes = skip_bytes;
+    so.skip_table = skip_table;
+    so.reverse = reverse;
+    so.littleendian = littleendian;
+    so.use_mmap = use_mmap;
+    so.verbose = verbose;
+    so.stride = stride;
+    so.header = header;
+    so.capture_fd = -1;
+    so.capture_map = NULL;
+    so.capture_size = 0;
+
+    /* The matrix goes to the output file, or stdout unless it is only being checked */
+    if (using_outfile==1) mfp = ofp;
+    else if (check==0) mfp = stdout;
+
+    if (check==1) {
+        matrix = (unsigned char *)malloc(1000*1000);
+        if (matrix == NULL) {
+            fprintf(stderr,"Error, failed to allocate the restart matrix\n");
+            exit(-1);
+        }
+    }
+
+    if (jobs == 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+    if (jobs > 1000) jobs = 1000;
+
+    /* framed records can come from stdin, a FIFO or a file */
+    if (framed==1) {
+        int fd = 0;
+        const char *streamname = "stdin";
+        if ((using_infile==1) && (strcmp(infilemask,"-") != 0)) {
+            streamname = infilemask;
+            fd = open(infilemask, O_RDONLY);
+            if (fd < 0) {
+                fprintf(stderr,"ERROR: Failed to open %s for reading\n",infilemask);
+                exit(-1);
+            }
+        }
+        if (verbose) fprintf(stderr,"Reading 1000 framed records from %s\n",streamname);
+        if (slice_stream(fd, streamname, mfp, matrix, &so) != 0) exit(-1);
+        if (fd != 0) close(fd);
+        if (mfp == stdout) cerr << "Wrote restart matrix to stdout." << endl;
+        else if (mfp != NULL) cerr << "Wrote restart file " << filename << " to disk." << endl;
+        if (using_outfile==1) fclose(ofp);
+        if (check==1) {
+            restart_result result;
+            if (restart_check(matrix, hi, jobs, full, verbose, &result) != 0) {
+                fprintf(stderr,"Error, failed to allocate the symbol counts\n");
+                exit(-1);
+            }
+            print_restart_result(&result);
+        }
+        exit(0);
+    }
+
     /* find the input files */
         // Since it's multiple files, you can't use std in.
     if (using_infile==0)
@@ -266,87 +1184,133 @@ int main(int argc, char** argv)
 
     filenamecount = p.we_wordc;
 
-    if (filenamecount != 1000) {
+    if ((stride == 0) && (filenamecount != 1000)) {
         fprintf(stderr,"ERROR filename did not expand to 1000 files - it expanded to %d files\n",filenamecount);
         exit(-1);
     }
+    if ((stride > 0) && (filenamecount != 1)) {
+        fprintf(stderr,"ERROR with a record stride the filename must expand to 1 capture file - it expanded to %d files\n",filenamecount);
+        exit(-1);
+    }
 
-    for (filenumber=0;filenumber<1000;filenumber++) {
-        if (verbose) fprintf(stderr,"File# %d, Filename %s\t",filenumber,w[filenumber]);
-
-        /* open the input file if needed */
-        strcpy(infilename,w[filenumber]);
-
-        ifp =  fopen(infilename, "rb");
-            
-        if (ifp == NULL) {
-            fprintf(stderr,"failed to open input file for reading");
-            exit(-1);
+    if (stride > 0) {
+        // Single-file mode: all 1000 rows come from records in one capture.
+        for (filenumber=0;filenumber<1000;filenumber++) {
+            if (header+file_skip(&so, filenumber)+(off_t)payload_bytes(&so) > stride) {
+                fprintf(stderr,"ERROR record %d: header + skip + %d data bytes do not fit in the %lld byte stride\n",filenumber,(int)payload_bytes(&so),(long long)stride);
+                exit(-1);
+            }
+            rownames[filenumber] = w[0];
         }
+        w = rownames;
 
-        // 1000 samples + skip_bytes is all the data we need
-        amount = (1+((1000*bps)/8))+skip_bytes; 
-        len = fread(buffer, 1, (size_t)amount , ifp);
-        amount = (1+((1000*bps)/8))+skip_bytes;
-        if (verbose) cerr <<"read " << len << "/" << amount << endl;
-        
-        if (len != amount) {
-            cerr << "Error only " << len << " bytes read" << endl;
+        so.capture_fd = open(w[0], O_RDONLY);
+        if (so.capture_fd < 0) {
+            fprintf(stderr,"ERROR: Failed to open capture file %s for reading\n",w[0]);
             exit(-1);
         }
-
-        // Read in buffer bytes into the FIFO of bits. One bit per byte.        
-        bitbuffer_index = 0;
-        
-        if (verbose) fprintf(stderr," skip_bytes=%d ",skip_bytes);
-        for (i=skip_bytes;i<len;i++) {
-            abyte = buffer[i];
-            if (verbose) fprintf(stderr,"%02x",abyte);
-            for(j=0;j<8;j++) {
-                if (reverse==0) {
-                    abit = (abyte & 0x01);
-                    abyte = abyte >> 1;
-                } else {
-                    abit = (abyte & 0x80) >> 7;
-                    abyte = abyte << 1;
+        if (use_mmap) {
+            struct stat st;
+            if (fstat(so.capture_fd, &st) != 0) {
+                perror("failed to stat capture file");
+                exit(-1);
+            }
+            so.capture_size = st.st_size;
+            if (so.capture_size > 0) {
+                void *map = mmap(NULL, (size_t)so.capture_size, PROT_READ, MAP_PRIVATE, so.capture_fd, 0);
+                if (map == MAP_FAILED) {
+                    perror("failed to mmap capture file");
+                    exit(-1);
                 }
-
-                bitbuffer[bitbuffer_index] = (unsigned char)abit;
-                bitbuffer_index++;
+                madvise(map, (size_t)so.capture_size, MADV_SEQUENTIAL);
+                madvise(map, (size_t)so.capture_size, MADV_WILLNEED);
+                so.capture_map = (const unsigned char *)map;
             }
         }
-        if (verbose) fprintf(stderr,"\n");
+        if (verbose) fprintf(stderr,"Reading 1000 records of %lld bytes with a %lld byte header from %s\n",(long long)stride,(long long)header,w[0]);
+    }
+
+    backend = use_mmap ? "mmap" : "pread";
 
-        // Work out how many full symbols are in the FIFO.
-        symbol_count = bitbuffer_index / bps;
-        if (verbose) fprintf(stderr,"Found %d symbols in buffer\n",symbol_count);
-        if (symbol_count < 1000) {
-            fprintf(stderr,"Not enough symbols in file %s, need 1000, got %d\n",infilename,symbol_count);
+    if (use_uring) {
+#ifdef HAVE_IO_URING
+        size_t amount = payload_bytes(&so);
+        unsigned char *pool = (unsigned char *)malloc(amount*1000);
+        if (matrix == NULL) matrix = (unsigned char *)malloc(1000*1000);
+        if ((pool == NULL) || (matrix == NULL)) {
+            fprintf(stderr,"Error, failed to allocate the restart matrix\n");
             exit(-1);
         }
 
-        //Pull bits from the but buffer and Write out the symbols (of 1 bit) as bytes;
-        for (i=0;i<1000;i++) {
-            abyte = 0;
-            for(j=0;j<bps;j++) {
-                abyte = abyte << 1;
-                abyte = abyte | bitbuffer[(i*bps)+j];
+        int rc = uring_read_files(w, pool, amount, &so);
+        if (rc < 0) exit(-1);
+        if (rc == 0) {
+            backend = "io_uring";
+            for (filenumber=0;filenumber<1000;filenumber++) {
+                if (unpack_row(pool+(filenumber*amount), amount, matrix+(1000*filenumber), &so, w[filenumber]) != 0) exit(-1);
             }
-            outbuffer[i] = abyte;
+            use_uring = 2;
+        } else {
+            fprintf(stderr,"io_uring is not available, falling back to pread\n");
         }
+        free(pool);
+#else
+        fprintf(stderr,"io_uring support was not compiled in, falling back to pread\n");
+#endif
+    }
 
-        if (using_outfile)
-            fwrite(outbuffer, 1000,1,ofp);
-        else
-            fwrite(outbuffer, 1000,1,stdout);
-        
-        //outindex = 0;
-        fclose(ifp);
+    if (use_uring == 2) {
+        // Already read by io_uring
+    } else if ((matrix == NULL) && (jobs == 1)) {
+        for (filenumber=0;filenumber<1000;filenumber++) {
+            if (slice_file(w[filenumber], filenumber, outbuffer, &so) != 0) exit(-1);
+            fwrite(outbuffer, 1000,1,mfp);
+        }
+    } else {
+        if (verbose) fprintf(stderr,"Reading input files with %d worker threads\n",jobs);
 
+        // The per-file lines of the workers would interleave, so they are only printed with -j 1.
+        if (jobs > 1) so.verbose = 0;
+
+        if (matrix == NULL) matrix = (unsigned char *)malloc(1000*1000);
+        if (matrix == NULL) {
+            fprintf(stderr,"Error, failed to allocate the restart matrix\n");
+            exit(-1);
+        }
+
+        slice_job job;
+        job.filenames = w;
+        job.matrix = matrix;
+        job.so = &so;
+        job.next = 0;
+        job.failed = 0;
+
+        std::thread *workers = new std::thread[jobs];
+        for (t=0;t<jobs;t++) workers[t] = std::thread(slice_worker, &job);
+        for (t=0;t<jobs;t++) workers[t].join();
+        delete [] workers;
+
+        if (job.failed) exit(-1);
     }
-    cout << "Wrote restart file " << filename << " to disk." << endl;    
+
+    if ((matrix != NULL) && (mfp != NULL)) fwrite(matrix, 1000,1000,mfp);
+    if (verbose || use_uring || use_mmap) fprintf(stderr,"Input backend: %s\n",backend);
+    if (so.capture_map != NULL) munmap((void *)so.capture_map, (size_t)so.capture_size);
+    if (so.capture_fd >= 0) close(so.capture_fd);
+    if (mfp == stdout) cerr << "Wrote restart matrix to stdout." << endl;
+    else if (mfp != NULL) cerr << "Wrote restart file " << filename << " to disk." << endl;
     if (using_outfile==1) fclose(ofp);
     wordfree(&p);
+
+    if (check==1) {
+        restart_result result;
+        if (restart_check(matrix, hi, jobs, full, verbose, &result) != 0) {
+            fprintf(stderr,"Error, failed to allocate the symbol counts\n");
+            exit(-1);
+        }
+        print_restart_result(&result);
+    }
+    free(matrix);
 }
 
 